@@ -0,0 +1,527 @@
+/*
+ * Standalone microbenchmark of the recording hot path, i.e. what happens
+ * for each sampled query in query_hist_add_query() - computing the bin and
+ * incrementing the count / time of the bin in the shared histogram.
+ *
+ * The shared segment is simulated by a plain struct shared by the threads
+ * (one thread = one backend), and the benchmark compares these designs:
+ *
+ *   exclusive - a single lock for the whole histogram (the current design
+ *               on PostgreSQL < 18), a test-and-test-and-set spinlock with
+ *               a spin delay, similar to what LWLock / s_lock do
+ *
+ *   atomic    - no lock at all, the bins are updated by atomic increments
+ *               (the time is kept as an integer number of microseconds, as
+ *               there are no atomic increments for doubles)
+ *
+ *   striped   - a number of histograms, each with a separate lock, and the
+ *               thread picks the stripe by its ID (the reader has to sum
+ *               all the stripes)
+ *
+ *   local     - each thread accumulates a local histogram, and merges it
+ *               into the shared one (under the lock) once in a while (the
+ *               design used on PostgreSQL 18 with the pgstat pending data)
+ *
+ * For each design and number of threads, it prints the time per operation
+ * (per thread, i.e. what a backend pays for each query), the aggregate
+ * throughput and the speedup compared to a single thread.
+ *
+ * Usage: hist_bench [-t max_threads] [-n ops_per_thread] [-d design]
+ *                   [-b bins] [-w width] [-l] [-s stripes] [-f flush_interval]
+ */
+#include <errno.h>
+#include <getopt.h>
+#include <math.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/* the same as in queryhist.h */
+#define HIST_BINS_MAX 1000
+
+#define HISTOGRAM_LINEAR	0
+#define HISTOGRAM_LOG		1
+
+#define CACHE_LINE_SIZE		64
+#define MAX_THREADS			256
+#define MAX_STRIPES			64
+
+/* spins before yielding the CPU (the default spins_per_delay in s_lock) */
+#define SPINS_PER_DELAY		100
+
+#define Min(x, y)			((x) < (y) ? (x) : (y))
+#define Max(x, y)			((x) > (y) ? (x) : (y))
+
+/* number of pre-generated durations per thread (power of 2) */
+#define DURATIONS			4096
+
+typedef long long count_bin_t;
+typedef double	time_bin_t;
+
+typedef enum {
+	DESIGN_EXCLUSIVE,
+	DESIGN_ATOMIC,
+	DESIGN_STRIPED,
+	DESIGN_LOCAL,
+	DESIGN_COUNT
+} design_t;
+
+static const char *design_names[] = {"exclusive", "atomic", "striped", "local"};
+
+/* simple spinlock, similar to the s_lock (TAS with a spin-delay) */
+typedef struct spinlock_t {
+	volatile int	locked;
+} __attribute__((aligned(CACHE_LINE_SIZE))) spinlock_t;
+
+/* the simulated shared segment (histogram_info_t without the extras) */
+typedef struct histogram_t {
+
+	spinlock_t	lock;
+
+	int			type;
+	int			bins;
+	int			step;
+
+	count_bin_t count_bins[HIST_BINS_MAX+1];
+	time_bin_t	time_bins[HIST_BINS_MAX+1];
+
+} __attribute__((aligned(CACHE_LINE_SIZE))) histogram_t;
+
+/* histogram updated by atomic increments (time in microseconds) */
+typedef struct atomic_histogram_t {
+
+	uint64_t	count_bins[HIST_BINS_MAX+1];
+	uint64_t	time_bins[HIST_BINS_MAX+1];
+
+} __attribute__((aligned(CACHE_LINE_SIZE))) atomic_histogram_t;
+
+typedef struct thread_arg_t {
+
+	int			id;
+	design_t	design;
+	long		ops;
+
+	time_bin_t	durations[DURATIONS];
+
+	/* when the thread started / finished the operations */
+	double		start;
+	double		end;
+
+	pthread_t	thread;
+
+} thread_arg_t;
+
+/* benchmark parameters */
+static int	max_threads = 0;
+static long	ops_per_thread = 10000000;
+static int	hist_bins = 100;
+static int	hist_step = 10;
+static int	hist_type = HISTOGRAM_LINEAR;
+static int	nstripes = 16;
+static int	flush_interval = 1000;
+
+static histogram_t shared;
+static atomic_histogram_t shared_atomic;
+static histogram_t stripes[MAX_STRIPES];
+
+/* start barrier, so that all threads start at the same time */
+static pthread_barrier_t barrier;
+
+static inline void
+spin_delay(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__asm__ __volatile__(" rep; nop \n");
+#elif defined(__aarch64__)
+	__asm__ __volatile__(" isb; \n");
+#endif
+}
+
+static inline void
+spin_lock(spinlock_t *lock)
+{
+	int		spins = 0;
+
+	for (;;)
+	{
+		if (! __atomic_exchange_n(&lock->locked, 1, __ATOMIC_ACQUIRE))
+			return;
+
+		/* test before another test-and-set, to not bounce the cache line,
+		 * and give up the CPU after a while (s_lock sleeps instead) */
+		while (__atomic_load_n(&lock->locked, __ATOMIC_RELAXED))
+		{
+			if (++spins % SPINS_PER_DELAY == 0)
+				sched_yield();
+			else
+				spin_delay();
+		}
+	}
+}
+
+static inline void
+spin_unlock(spinlock_t *lock)
+{
+	__atomic_store_n(&lock->locked, 0, __ATOMIC_RELEASE);
+}
+
+/* the same as get_hist_bin() in queryhist.c */
+static inline int
+get_hist_bin(int type, int bins, int step, time_bin_t duration)
+{
+	int bin = 0;
+
+	if (type == HISTOGRAM_LINEAR) {
+		bin = (int)floor((duration * 1000.0) / step);
+	} else {
+		bin = (int)floor(log2(1 + ((duration * 1000.0) / step)));
+	}
+
+	return (bin >= bins) ? bins : bin;
+}
+
+/* the same as query_hist_add_query() in queryhist.c (needs to be locked) */
+static inline void
+add_query(histogram_t *hist, time_bin_t duration)
+{
+	int bin = get_hist_bin(hist->type, hist->bins, hist->step, duration);
+
+	hist->count_bins[bin] += 1;
+	hist->time_bins[bin] += duration;
+}
+
+static void
+hist_init(histogram_t *hist)
+{
+	memset(hist, 0, sizeof(histogram_t));
+
+	hist->type = hist_type;
+	hist->bins = hist_bins;
+	hist->step = hist_step;
+}
+
+/* xorshift, good enough for generating the durations */
+static uint64_t
+next_random(uint64_t *state)
+{
+	uint64_t x = *state;
+
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+
+	return (*state = x);
+}
+
+/* log-uniform durations between 10us and ~10s, so that both the short and
+ * the long bins (and the overflow bin) get some queries */
+static void
+generate_durations(thread_arg_t *arg)
+{
+	int			i;
+	uint64_t	state = 0x9E3779B97F4A7C15ULL * (arg->id + 1);
+
+	for (i = 0; i < DURATIONS; i++)
+	{
+		double u = (double) (next_random(&state) >> 11) / (double) (1ULL << 53);
+
+		arg->durations[i] = 0.00001 * pow(10, 6 * u);
+	}
+}
+
+static double
+now_seconds(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *
+bench_thread(void *ptr)
+{
+	thread_arg_t *arg = (thread_arg_t *) ptr;
+	histogram_t	*stripe = &stripes[arg->id % nstripes];
+	histogram_t	local;
+	long		i;
+	int			j;
+
+	hist_init(&local);
+
+	pthread_barrier_wait(&barrier);
+
+	arg->start = now_seconds();
+
+	switch (arg->design)
+	{
+		case DESIGN_EXCLUSIVE:
+			for (i = 0; i < arg->ops; i++)
+			{
+				spin_lock(&shared.lock);
+				add_query(&shared, arg->durations[i & (DURATIONS - 1)]);
+				spin_unlock(&shared.lock);
+			}
+			break;
+
+		case DESIGN_ATOMIC:
+			for (i = 0; i < arg->ops; i++)
+			{
+				time_bin_t	duration = arg->durations[i & (DURATIONS - 1)];
+				int			bin = get_hist_bin(hist_type, hist_bins, hist_step, duration);
+
+				__atomic_fetch_add(&shared_atomic.count_bins[bin], 1, __ATOMIC_RELAXED);
+				__atomic_fetch_add(&shared_atomic.time_bins[bin],
+								   (uint64_t) (duration * 1000000.0), __ATOMIC_RELAXED);
+			}
+			break;
+
+		case DESIGN_STRIPED:
+			for (i = 0; i < arg->ops; i++)
+			{
+				spin_lock(&stripe->lock);
+				add_query(stripe, arg->durations[i & (DURATIONS - 1)]);
+				spin_unlock(&stripe->lock);
+			}
+			break;
+
+		case DESIGN_LOCAL:
+			for (i = 0; i < arg->ops; i++)
+			{
+				add_query(&local, arg->durations[i & (DURATIONS - 1)]);
+
+				/* merge the pending data (and at the end) */
+				if (((i + 1) % flush_interval == 0) || (i + 1 == arg->ops))
+				{
+					spin_lock(&shared.lock);
+					for (j = 0; j <= hist_bins; j++)
+					{
+						shared.count_bins[j] += local.count_bins[j];
+						shared.time_bins[j]  += local.time_bins[j];
+					}
+					spin_unlock(&shared.lock);
+
+					memset(local.count_bins, 0, sizeof(local.count_bins));
+					memset(local.time_bins,  0, sizeof(local.time_bins));
+				}
+			}
+			break;
+
+		default:
+			break;
+	}
+
+	arg->end = now_seconds();
+
+	return NULL;
+}
+
+/* total number of queries in the histogram(s), to check nothing got lost */
+static count_bin_t
+total_count(design_t design)
+{
+	int			i, j;
+	count_bin_t	total = 0;
+
+	for (i = 0; i <= hist_bins; i++)
+	{
+		if (design == DESIGN_ATOMIC)
+			total += shared_atomic.count_bins[i];
+		else if (design == DESIGN_STRIPED)
+			for (j = 0; j < nstripes; j++)
+				total += stripes[j].count_bins[i];
+		else
+			total += shared.count_bins[i];
+	}
+
+	return total;
+}
+
+/* runs the design with the number of threads, returns ns per operation
+ * (per thread) and the throughput (ops per second, all threads) */
+static int
+run_bench(design_t design, int nthreads, thread_arg_t *args,
+		  double *ns_per_op, double *throughput)
+{
+	int			i;
+	double		start, end;
+
+	hist_init(&shared);
+	memset(&shared_atomic, 0, sizeof(shared_atomic));
+	for (i = 0; i < nstripes; i++)
+		hist_init(&stripes[i]);
+
+	pthread_barrier_init(&barrier, NULL, nthreads + 1);
+
+	for (i = 0; i < nthreads; i++)
+	{
+		args[i].design = design;
+		args[i].ops = ops_per_thread;
+
+		if (pthread_create(&args[i].thread, NULL, bench_thread, &args[i]) != 0)
+		{
+			fprintf(stderr, "pthread_create failed: %s\n", strerror(errno));
+			exit(1);
+		}
+	}
+
+	pthread_barrier_wait(&barrier);
+
+	for (i = 0; i < nthreads; i++)
+		pthread_join(args[i].thread, NULL);
+
+	pthread_barrier_destroy(&barrier);
+
+	/*
+	 * The timestamps are taken by the threads themselves, so that the time
+	 * it takes to wake up the main thread after the barrier does not count.
+	 * From the first thread to start to the last one to finish.
+	 */
+	start = args[0].start;
+	end = args[0].end;
+
+	for (i = 1; i < nthreads; i++)
+	{
+		start = Min(start, args[i].start);
+		end = Max(end, args[i].end);
+	}
+
+	*ns_per_op = (end - start) * 1e9 / ops_per_thread;
+	*throughput = (nthreads * ops_per_thread) / (end - start);
+
+	if (total_count(design) != (count_bin_t) nthreads * ops_per_thread)
+	{
+		fprintf(stderr, "%s: lost queries (%lld instead of %lld)\n",
+				design_names[design], total_count(design),
+				(count_bin_t) nthreads * ops_per_thread);
+		return 1;
+	}
+
+	return 0;
+}
+
+static void
+usage(const char *progname)
+{
+	printf("Usage: %s [options]\n\n", progname);
+	printf("  -t threads   maximum number of threads (default: number of CPUs)\n");
+	printf("  -n ops       operations per thread (default: %ld)\n", ops_per_thread);
+	printf("  -d design    exclusive, atomic, striped or local (default: all)\n");
+	printf("  -b bins      number of histogram bins (default: %d)\n", hist_bins);
+	printf("  -w width     bin width in ms (default: %d)\n", hist_step);
+	printf("  -l           logarithmic bins (default: linear)\n");
+	printf("  -s stripes   number of stripes (default: %d)\n", nstripes);
+	printf("  -f ops       local design: merge every N operations (default: %d)\n",
+		   flush_interval);
+}
+
+int
+main(int argc, char **argv)
+{
+	int			c, i;
+	int			design = -1;
+	int			errors = 0;
+	thread_arg_t *args;
+
+	while ((c = getopt(argc, argv, "t:n:d:b:w:ls:f:h")) != -1)
+	{
+		switch (c)
+		{
+			case 't':
+				max_threads = atoi(optarg);
+				break;
+			case 'n':
+				ops_per_thread = atol(optarg);
+				break;
+			case 'd':
+				for (i = 0; i < DESIGN_COUNT; i++)
+					if (strcmp(optarg, design_names[i]) == 0)
+						design = i;
+				if (design == -1) {
+					fprintf(stderr, "unknown design '%s'\n", optarg);
+					return 1;
+				}
+				break;
+			case 'b':
+				hist_bins = atoi(optarg);
+				break;
+			case 'w':
+				hist_step = atoi(optarg);
+				break;
+			case 'l':
+				hist_type = HISTOGRAM_LOG;
+				break;
+			case 's':
+				nstripes = atoi(optarg);
+				break;
+			case 'f':
+				flush_interval = atoi(optarg);
+				break;
+			default:
+				usage(argv[0]);
+				return (c == 'h') ? 0 : 1;
+		}
+	}
+
+	if (max_threads <= 0)
+		max_threads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+
+	if ((max_threads < 1) || (max_threads > MAX_THREADS) ||
+		(ops_per_thread < 1) || (hist_bins < 1) || (hist_bins > HIST_BINS_MAX) ||
+		(hist_step < 1) || (nstripes < 1) || (nstripes > MAX_STRIPES) ||
+		(flush_interval < 1))
+	{
+		fprintf(stderr, "invalid parameters\n");
+		usage(argv[0]);
+		return 1;
+	}
+
+	args = (thread_arg_t *) calloc(max_threads, sizeof(thread_arg_t));
+	for (i = 0; i < max_threads; i++)
+	{
+		args[i].id = i;
+		generate_durations(&args[i]);
+	}
+
+	printf("bins %d (%s, width %d ms), %ld ops per thread, %d stripes, local flush every %d ops\n\n",
+		   hist_bins, (hist_type == HISTOGRAM_LINEAR) ? "linear" : "log",
+		   hist_step, ops_per_thread, nstripes, flush_interval);
+
+	printf("%-10s %8s %12s %14s %9s\n", "design", "threads", "ns/op", "Mops/s", "scaling");
+
+	for (c = 0; c < DESIGN_COUNT; c++)
+	{
+		double	base = 0;
+		int		nthreads;
+
+		if ((design != -1) && (design != c))
+			continue;
+
+		/* 1, 2, 4, ... threads, and the maximum */
+		for (nthreads = 1; ; nthreads = Min(nthreads * 2, max_threads))
+		{
+			double	ns_per_op, throughput;
+
+			errors += run_bench(c, nthreads, args, &ns_per_op, &throughput);
+
+			if (nthreads == 1)
+				base = throughput;
+
+			printf("%-10s %8d %12.1f %14.2f %8.2fx\n", design_names[c], nthreads,
+				   ns_per_op, throughput / 1e6, throughput / base);
+
+			if (nthreads == max_threads)
+				break;
+		}
+	}
+
+	free(args);
+
+	return (errors > 0) ? 1 : 0;
+}
@@ -0,0 +1,185 @@
+#!/usr/bin/env bash
+#
+# End-to-end overhead of the extension, measured with pgbench.
+#
+# Creates a throwaway cluster (initdb in a temporary directory, started on
+# a separate port), and runs pgbench with several workloads and numbers of
+# clients, for each configuration:
+#
+#   off          - the extension is not loaded at all (the baseline)
+#   bins0        - loaded, but with bin_count = 0 (just the hooks)
+#   dynamic-N    - dynamic = on, sample_pct = N
+#   static-N     - dynamic = off, sample_pct = N
+#
+# and then prints the TPS and p99 latency of each run compared to the
+# baseline with the same workload and number of clients.
+#
+# The extension has to be installed (make install) into the installation
+# the binaries come from. The parameters may be set using environment
+# variables, e.g.
+#
+#   $ DURATION=60 CLIENTS="1 8" LOADS="select1" ./bench/overhead.sh
+#
+# The raw results (TSV) are written into RESULTS (overhead.tsv by default).
+
+set -e
+
+PG_BINDIR=${PG_BINDIR:-$(pg_config --bindir)}
+PORT=${PORT:-55432}
+SCALE=${SCALE:-10}
+DURATION=${DURATION:-30}
+CLIENTS=${CLIENTS:-"1 8 64"}
+LOADS=${LOADS:-"select1 select-only tpcb"}
+SAMPLE_PCTS=${SAMPLE_PCTS:-"1 5 100"}
+CONFIGS=${CONFIGS:-"off bins0 $(for p in $SAMPLE_PCTS; do echo -n "dynamic-$p static-$p "; done)"}
+PROTOCOL=${PROTOCOL:-prepared}
+RESULTS=${RESULTS:-overhead.tsv}
+
+# number of pgbench threads is limited by the number of CPUs
+NCPUS=$(getconf _NPROCESSORS_ONLN)
+
+if [ ! -f "$("$PG_BINDIR/pg_config" --pkglibdir)/query_histogram.so" ]; then
+	echo "query_histogram.so not found in $("$PG_BINDIR/pg_config" --pkglibdir), run 'make install' first" >&2
+	exit 1
+fi
+
+WORKDIR=$(mktemp -d -t query_histogram_bench.XXXXXX)
+PGDATA=$WORKDIR/data
+
+export PGPORT=$PORT
+export PGHOST=$WORKDIR
+export PGDATABASE=postgres
+
+cleanup() {
+	"$PG_BINDIR/pg_ctl" -D "$PGDATA" -m immediate stop > /dev/null 2>&1 || true
+	rm -rf "$WORKDIR"
+}
+
+trap cleanup EXIT
+
+# the extension config, included from postgresql.conf
+write_config() {
+	local config=$1
+
+	case $config in
+		off)
+			echo "" ;;
+		bins0)
+			echo "shared_preload_libraries = 'query_histogram'"
+			echo "query_histogram.bin_count = 0" ;;
+		dynamic-*)
+			echo "shared_preload_libraries = 'query_histogram'"
+			echo "query_histogram.dynamic = on"
+			echo "query_histogram.sample_pct = ${config#dynamic-}" ;;
+		static-*)
+			echo "shared_preload_libraries = 'query_histogram'"
+			echo "query_histogram.dynamic = off"
+			echo "query_histogram.sample_pct = ${config#static-}" ;;
+		*)
+			echo "unknown configuration '$config'" >&2
+			exit 1 ;;
+	esac > "$PGDATA/query_histogram.conf"
+}
+
+# 99th percentile (nearest rank) of latency (in ms) from the pgbench transaction logs
+# (the third column is the latency in microseconds)
+latency_p99() {
+	cat "$@" | awk '{print $3}' | sort -n | awk '
+		{ lat[NR] = $1 }
+		END {
+			if (NR == 0) { print "NaN"; exit }
+			idx = int(NR * 0.99); if (idx < NR * 0.99) idx++;
+			printf "%.3f\n", lat[idx] / 1000.0
+		}'
+}
+
+# runs pgbench, prints "tps p99"
+run_pgbench() {
+	local load=$1
+	local clients=$2
+	local threads=$(( clients < NCPUS ? clients : NCPUS ))
+	local logdir=$WORKDIR/log
+	local args tps
+
+	case $load in
+		select1)
+			echo "SELECT 1;" > "$WORKDIR/select1.sql"
+			args="-f $WORKDIR/select1.sql" ;;
+		select-only)
+			args="-S" ;;
+		tpcb)
+			args="" ;;
+		*)
+			echo "unknown workload '$load'" >&2
+			exit 1 ;;
+	esac
+
+	rm -rf "$logdir"
+	mkdir "$logdir"
+
+	tps=$("$PG_BINDIR/pgbench" $args -M "$PROTOCOL" -c "$clients" -j "$threads" \
+			-T "$DURATION" -l --log-prefix="$logdir/pgbench" 2>/dev/null |
+		  awk '/^tps = / {print $3; exit}')
+
+	echo "$tps $(latency_p99 "$logdir"/pgbench*)"
+}
+
+echo "initializing cluster in $WORKDIR (port $PORT)"
+
+"$PG_BINDIR/initdb" -D "$PGDATA" -A trust > "$WORKDIR/initdb.log" 2>&1
+
+cat >> "$PGDATA/postgresql.conf" <<EOF
+listen_addresses = ''
+unix_socket_directories = '$WORKDIR'
+max_connections = 200
+shared_buffers = 512MB
+include_if_exists = 'query_histogram.conf'
+EOF
+
+write_config off
+
+"$PG_BINDIR/pg_ctl" -D "$PGDATA" -l "$WORKDIR/postgres.log" -w start > /dev/null
+"$PG_BINDIR/pgbench" -i -s "$SCALE" -q > /dev/null 2>&1
+"$PG_BINDIR/pg_ctl" -D "$PGDATA" -w stop > /dev/null
+
+printf "config\tload\tclients\ttps\tp99_ms\n" > "$RESULTS"
+
+for config in $CONFIGS; do
+
+	write_config "$config"
+	"$PG_BINDIR/pg_ctl" -D "$PGDATA" -l "$WORKDIR/postgres.log" -w start > /dev/null
+
+	for load in $LOADS; do
+		for clients in $CLIENTS; do
+
+			read -r tps p99 <<< "$(run_pgbench "$load" "$clients")"
+
+			printf "%s\t%s\t%s\t%s\t%s\n" "$config" "$load" "$clients" "$tps" "$p99" >> "$RESULTS"
+			printf "%-12s %-12s %4d clients  %12.1f tps  p99 %8.3f ms\n" \
+				   "$config" "$load" "$clients" "$tps" "$p99"
+
+		done
+	done
+
+	"$PG_BINDIR/pg_ctl" -D "$PGDATA" -w stop > /dev/null
+
+done
+
+# compare each run to the baseline (same workload and clients)
+echo
+awk -F '\t' '
+	NR == 1 { next }
+	$1 == "off" { base_tps[$2, $3] = $4; base_p99[$2, $3] = $5 }
+	{ rows[NR] = $0 }
+	END {
+		printf "%-12s %-12s %8s %12s %9s %10s %10s\n",
+			   "config", "load", "clients", "tps", "tps delta", "p99 [ms]", "p99 delta"
+		for (i = 2; i <= NR; i++) {
+			split(rows[i], r, "\t")
+			key = r[2] SUBSEP r[3]
+			tps_delta = (base_tps[key] > 0) ? sprintf("%+.1f%%", 100.0 * (r[4] - base_tps[key]) / base_tps[key]) : "-"
+			p99_delta = (key in base_p99) ? sprintf("%+.3f", r[5] - base_p99[key]) : "-"
+			printf "%-12s %-12s %8d %12.1f %9s %10.3f %10s\n",
+				   r[1], r[2], r[3], r[4], tps_delta, r[5], p99_delta
+		}
+	}' "$RESULTS"
@@ -0,0 +1,152 @@
+-- complain if script is sourced in psql, rather than via ALTER EXTENSION
+\echo Use "ALTER EXTENSION query_histogram UPDATE TO '1.2'" to load this file. \quit
+
+-- the 1.1 script used to declare xact_histogram(), which has no C function behind it (so it only
+-- worked with check_function_bodies = off), drop it so that the upgraded installs match the new ones
+DROP VIEW IF EXISTS xact_histogram;
+DROP FUNCTION IF EXISTS xact_histogram(BOOLEAN);
+
+CREATE OR REPLACE FUNCTION query_histogram_metric( IN metric TEXT, IN scale BOOLEAN DEFAULT TRUE,
+                                                   OUT bin_from DOUBLE PRECISION, OUT bin_to DOUBLE PRECISION,
+                                                   OUT bin_count BIGINT, OUT bin_count_pct REAL,
+                                                   OUT bin_value DOUBLE PRECISION, OUT bin_value_pct REAL,
+                                                   OUT bin_time DOUBLE PRECISION, OUT bin_time_pct REAL)
+    RETURNS SETOF record
+    AS 'MODULE_PATHNAME', 'query_histogram_metric'
+    LANGUAGE C VOLATILE STRICT;
+
+CREATE OR REPLACE FUNCTION query_histogram_heatmap( IN scale BOOLEAN DEFAULT TRUE,
+                                                    OUT duration_from DOUBLE PRECISION, OUT duration_to DOUBLE PRECISION,
+                                                    OUT rows_from BIGINT, OUT rows_to BIGINT, OUT bin_count BIGINT)
+    RETURNS SETOF record
+    AS 'MODULE_PATHNAME', 'query_histogram_heatmap'
+    LANGUAGE C VOLATILE STRICT;
+
+CREATE OR REPLACE VIEW query_histogram_jit AS
+    SELECT
+        histogram.*,
+        round(100000 * bin_value / (CASE WHEN bin_time > 0 THEN 1000 * bin_time ELSE 1 END)) / 1000 AS jit_pct
+    FROM query_histogram_metric('jit_time', true) histogram;
+
+CREATE OR REPLACE FUNCTION query_histogram_plans( IN scale BOOLEAN DEFAULT TRUE,
+                                                  OUT dbid OID, OUT queryid BIGINT, OUT planid BIGINT,
+                                                  OUT bin_from DOUBLE PRECISION, OUT bin_to DOUBLE PRECISION,
+                                                  OUT bin_count BIGINT, OUT bin_time DOUBLE PRECISION)
+    RETURNS SETOF record
+    AS 'MODULE_PATHNAME', 'query_histogram_plans'
+    LANGUAGE C VOLATILE STRICT;
+
+CREATE OR REPLACE VIEW query_histogram_plans AS
+    SELECT
+        dbid, queryid, planid,
+        sum(bin_count) AS calls,
+        sum(bin_time) AS total_time,
+        round(1000000 * sum(bin_time) / sum(bin_count)) / 1000 AS avg_time
+    FROM query_histogram_plans(true)
+    GROUP BY dbid, queryid, planid;
+
+CREATE OR REPLACE FUNCTION query_histogram_nodes( IN scale BOOLEAN DEFAULT TRUE,
+                                                  OUT node_type TEXT,
+                                                  OUT bin_from DOUBLE PRECISION, OUT bin_to DOUBLE PRECISION,
+                                                  OUT bin_count BIGINT, OUT bin_time DOUBLE PRECISION)
+    RETURNS SETOF record
+    AS 'MODULE_PATHNAME', 'query_histogram_nodes'
+    LANGUAGE C VOLATILE STRICT;
+
+CREATE OR REPLACE VIEW query_histogram_nodes AS
+    SELECT
+        node_type,
+        sum(bin_count) AS count,
+        sum(bin_time) AS total_time,
+        round(100000 * sum(bin_time) / sum(sum(bin_time)) OVER ()) / 1000 AS total_time_pct
+    FROM query_histogram_nodes(true)
+    GROUP BY node_type;
+
+CREATE OR REPLACE FUNCTION query_histogram_inflight( OUT bin_from INT, OUT bin_to INT, OUT bin_count BIGINT, OUT bin_count_pct REAL,
+                                                     OUT bin_time DOUBLE PRECISION, OUT bin_time_pct REAL)
+    RETURNS SETOF record
+    AS 'MODULE_PATHNAME', 'query_histogram_inflight'
+    LANGUAGE C VOLATILE STRICT;
+
+CREATE OR REPLACE FUNCTION query_histogram_waits( OUT wait_event_type TEXT, OUT wait_event TEXT,
+                                                  OUT bin_from DOUBLE PRECISION, OUT bin_to DOUBLE PRECISION,
+                                                  OUT bin_count BIGINT, OUT bin_time DOUBLE PRECISION)
+    RETURNS SETOF record
+    AS 'MODULE_PATHNAME', 'query_histogram_waits'
+    LANGUAGE C VOLATILE STRICT;
+
+CREATE OR REPLACE VIEW query_histogram_waits AS
+    SELECT
+        wait_event_type,
+        wait_event,
+        sum(bin_count) AS count,
+        sum(bin_time) AS total_time,
+        round(100000 * sum(bin_time) / sum(sum(bin_time)) OVER ()) / 1000 AS total_time_pct
+    FROM query_histogram_waits()
+    GROUP BY wait_event_type, wait_event;
+
+CREATE OR REPLACE FUNCTION query_histogram_concurrency( IN scale BOOLEAN DEFAULT TRUE,
+                                                        OUT duration_from DOUBLE PRECISION, OUT duration_to DOUBLE PRECISION,
+                                                        OUT concurrency_from INT, OUT concurrency_to INT,
+                                                        OUT bin_count BIGINT)
+    RETURNS SETOF record
+    AS 'MODULE_PATHNAME', 'query_histogram_concurrency'
+    LANGUAGE C VOLATILE STRICT;
+
+CREATE OR REPLACE FUNCTION query_histogram_slowest( OUT queryid BIGINT, OUT dbid OID, OUT userid OID,
+                                                    OUT duration DOUBLE PRECISION, OUT recorded_at TIMESTAMPTZ,
+                                                    OUT query TEXT)
+    RETURNS SETOF record
+    AS 'MODULE_PATHNAME', 'query_histogram_slowest'
+    LANGUAGE C VOLATILE STRICT;
+
+CREATE OR REPLACE VIEW query_histogram_slowest AS
+    SELECT * FROM query_histogram_slowest() ORDER BY duration DESC;
+
+-- query_histogram() returns the exemplars and confidence intervals too, so the function and the view
+-- have to be recreated (the result type is different)
+DROP VIEW query_histogram;
+DROP FUNCTION query_histogram(BOOLEAN);
+
+CREATE FUNCTION query_histogram( IN scale BOOLEAN DEFAULT TRUE, OUT bin_from INT, OUT bin_to INT, OUT bin_count BIGINT, OUT bin_count_pct REAL,
+                                 OUT bin_time DOUBLE PRECISION, OUT bin_time_pct REAL,
+                                 OUT exemplar_queryid BIGINT, OUT exemplar_pid INT,
+                                 OUT exemplar_time TIMESTAMPTZ, OUT exemplar_query TEXT,
+                                 OUT bin_count_low DOUBLE PRECISION, OUT bin_count_high DOUBLE PRECISION)
+    RETURNS SETOF record
+    AS 'MODULE_PATHNAME', 'query_histogram'
+    LANGUAGE C VOLATILE;
+
+CREATE VIEW query_histogram AS
+    SELECT
+        histogram.*,
+        round(1000000 * bin_time / (CASE WHEN bin_count > 0 THEN bin_count ELSE 1 END)) / 1000 AS bin_time_avg
+    FROM query_histogram(true) histogram;
+
+CREATE OR REPLACE FUNCTION query_histogram_captured_plans( OUT queryid BIGINT, OUT dbid OID,
+                                                           OUT duration DOUBLE PRECISION, OUT captured_at TIMESTAMPTZ,
+                                                           OUT plan TEXT)
+    RETURNS SETOF record
+    AS 'MODULE_PATHNAME', 'query_histogram_captured_plans'
+    LANGUAGE C VOLATILE STRICT;
+
+CREATE OR REPLACE FUNCTION query_histogram_internal_stats( OUT recorded BIGINT, OUT skipped BIGINT,
+                                                           OUT lock_acquisitions BIGINT, OUT lock_wait_samples BIGINT,
+                                                           OUT lock_wait_time DOUBLE PRECISION,
+                                                           OUT hook_calls BIGINT, OUT hook_samples BIGINT,
+                                                           OUT hook_time DOUBLE PRECISION)
+    AS 'MODULE_PATHNAME', 'query_histogram_internal_stats'
+    LANGUAGE C VOLATILE STRICT;
+
+CREATE OR REPLACE FUNCTION query_histogram_clock_bench( IN loops INT DEFAULT 1000000,
+                                                        OUT clock TEXT, OUT available BOOLEAN, OUT selected BOOLEAN,
+                                                        OUT ns_per_call DOUBLE PRECISION, OUT resolution_ns DOUBLE PRECISION)
+    RETURNS SETOF record
+    AS 'MODULE_PATHNAME', 'query_histogram_clock_bench'
+    LANGUAGE C VOLATILE STRICT;
+
+CREATE OR REPLACE FUNCTION query_histogram_percentile( IN fraction DOUBLE PRECISION, IN confidence DOUBLE PRECISION DEFAULT 0.95,
+                                                       OUT value DOUBLE PRECISION, OUT value_low DOUBLE PRECISION,
+                                                       OUT value_high DOUBLE PRECISION, OUT sample_count BIGINT)
+    AS 'MODULE_PATHNAME', 'query_histogram_percentile'
+    LANGUAGE C VOLATILE STRICT;
@@ -9,6 +9,8 @@
 #include "fmgr.h"
 
 #include "funcapi.h"
+#include "pgstat.h"
+#include "utils/builtins.h"
 
 #if (PG_VERSION_NUM >= 90300)
 #include "access/htup_details.h"
@@ -21,13 +23,55 @@ PG_MODULE_MAGIC;
 PG_FUNCTION_INFO_V1(query_histogram);
 PG_FUNCTION_INFO_V1(query_histogram_reset);
 PG_FUNCTION_INFO_V1(query_histogram_get_reset);
+PG_FUNCTION_INFO_V1(query_histogram_metric);
+PG_FUNCTION_INFO_V1(query_histogram_heatmap);
+PG_FUNCTION_INFO_V1(query_histogram_plans);
+PG_FUNCTION_INFO_V1(query_histogram_nodes);
+PG_FUNCTION_INFO_V1(query_histogram_inflight);
+PG_FUNCTION_INFO_V1(query_histogram_waits);
+PG_FUNCTION_INFO_V1(query_histogram_concurrency);
+PG_FUNCTION_INFO_V1(query_histogram_slowest);
+PG_FUNCTION_INFO_V1(query_histogram_captured_plans);
+PG_FUNCTION_INFO_V1(query_histogram_internal_stats);
+PG_FUNCTION_INFO_V1(query_histogram_clock_bench);
+PG_FUNCTION_INFO_V1(query_histogram_percentile);
 
 Datum query_histogram(PG_FUNCTION_ARGS);
 Datum query_histogram_reset(PG_FUNCTION_ARGS);
 Datum query_histogram_get_reset(PG_FUNCTION_ARGS);
+Datum query_histogram_metric(PG_FUNCTION_ARGS);
+Datum query_histogram_heatmap(PG_FUNCTION_ARGS);
+Datum query_histogram_plans(PG_FUNCTION_ARGS);
+Datum query_histogram_nodes(PG_FUNCTION_ARGS);
+Datum query_histogram_inflight(PG_FUNCTION_ARGS);
+Datum query_histogram_waits(PG_FUNCTION_ARGS);
+Datum query_histogram_concurrency(PG_FUNCTION_ARGS);
+Datum query_histogram_slowest(PG_FUNCTION_ARGS);
+Datum query_histogram_captured_plans(PG_FUNCTION_ARGS);
+Datum query_histogram_internal_stats(PG_FUNCTION_ARGS);
+Datum query_histogram_clock_bench(PG_FUNCTION_ARGS);
+Datum query_histogram_percentile(PG_FUNCTION_ARGS);
+
+static Datum histogram_srf(FunctionCallInfo fcinfo, bool inflight);
 
 Datum
 query_histogram(PG_FUNCTION_ARGS)
+{
+	return histogram_srf(fcinfo, false);
+}
+
+/* histogram of the currently running queries (by their current age) */
+Datum
+query_histogram_inflight(PG_FUNCTION_ARGS)
+{
+	return histogram_srf(fcinfo, true);
+}
+
+/* the regular and in-flight histograms have the same bins, the in-flight one
+ * returns only the bin columns (the tuple is formed using the descriptor, so
+ * the exemplar and interval values are simply ignored) */
+static Datum
+histogram_srf(FunctionCallInfo fcinfo, bool inflight)
 {
 	FuncCallContext *funcctx;
 	TupleDesc	   tupdesc;
@@ -42,7 +86,10 @@ query_histogram(PG_FUNCTION_ARGS)
 		funcctx = SRF_FIRSTCALL_INIT();
 		oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
 
-		data = query_hist_get_data(PG_GETARG_BOOL(0));
+		if (inflight)
+			data = query_hist_get_inflight_data();
+		else
+			data = query_hist_get_data(PG_GETARG_BOOL(0));
 
 		/* init (open file, etc.), maybe read all the data in memory
 		 * so that the file is not kept open for a long time */
@@ -81,8 +128,8 @@ query_histogram(PG_FUNCTION_ARGS)
 	{
 		HeapTuple	   tuple;
 		Datum		   result;
-		Datum		   values[6];
-		bool			nulls[6];
+		Datum		   values[12];
+		bool			nulls[12];
 
 		int binIdx;
 
@@ -92,31 +139,15 @@ query_histogram(PG_FUNCTION_ARGS)
 
 		memset(nulls, 0, sizeof(nulls));
 
-		if (data->histogram_type == HISTOGRAM_LINEAR) {
+		values[0] = UInt32GetDatum(query_hist_bin_lower(data->histogram_type,
+														data->bins_width, binIdx));
 
-			values[0] = UInt32GetDatum(binIdx * data->bins_width);
-
-			if (funcctx->max_calls - 1 == funcctx->call_cntr) {
-				values[1] = UInt32GetDatum(0);
-				nulls[1] = TRUE;
-			} else {
-				values[1] = UInt32GetDatum((binIdx+1)* data->bins_width);
-			}
+		if (funcctx->max_calls - 1 == funcctx->call_cntr) {
+			values[1] = UInt32GetDatum(0);
+			nulls[1] = true;
 		} else {
-
-			if (funcctx->call_cntr == 0) {
-				values[0] = UInt32GetDatum(0);
-			} else {
-				values[0] = UInt32GetDatum(pow(2,binIdx-1) * data->bins_width);
-			}
-
-			if (funcctx->max_calls - 1 == funcctx->call_cntr) {
-				values[1] = UInt32GetDatum(0);
-				nulls[1] = TRUE;
-			} else {
-				values[1] = UInt32GetDatum(pow(2,binIdx) * data->bins_width);
-			}
-
+			values[1] = UInt32GetDatum(query_hist_bin_upper(data->histogram_type,
+															data->bins_width, binIdx));
 		}
 
 		values[2] = Int64GetDatum(data->count_data[binIdx]);
@@ -135,6 +166,39 @@ query_histogram(PG_FUNCTION_ARGS)
 			values[5] = Float4GetDatum(0);
 		}
 
+		/* the most recent statement in the bin (if any) */
+		if (data->exemplars && (data->exemplars[binIdx].pid != 0)) {
+
+			histogram_exemplar_t *exemplar = &(data->exemplars[binIdx]);
+
+			values[6] = Int64GetDatum((int64) exemplar->queryid);
+			values[7] = Int32GetDatum(exemplar->pid);
+			values[8] = TimestampTzGetDatum(exemplar->timestamp);
+
+			if (exemplar->query[0] != '\0')
+				values[9] = CStringGetTextDatum(exemplar->query);
+			else
+				nulls[9] = true;
+
+		} else {
+			nulls[6] = nulls[7] = nulls[8] = nulls[9] = true;
+		}
+
+		/* confidence interval of the count (only for the scaled histogram) */
+		if (data->sample_data) {
+
+			double low, high;
+
+			query_hist_count_interval(data->sample_data[binIdx], data->sample_pct,
+									  HISTOGRAM_CI_CONFIDENCE, &low, &high);
+
+			values[10] = Float8GetDatum(low);
+			values[11] = Float8GetDatum(high);
+
+		} else {
+			nulls[10] = nulls[11] = true;
+		}
+
 		/* Build and return the tuple. */
 		tuple = heap_form_tuple(funcctx->tuple_desc, values, nulls);
 
@@ -157,6 +221,11 @@ Datum
 query_histogram_reset(PG_FUNCTION_ARGS)
 {
 	query_hist_reset(false);
+	query_hist_plans_reset();
+	query_hist_waits_reset();
+	query_hist_slowest_reset();
+	query_hist_capture_reset();
+	query_hist_internal_reset();
 	PG_RETURN_VOID();
 }
 
@@ -165,3 +234,1097 @@ query_histogram_get_reset(PG_FUNCTION_ARGS)
 {
 	PG_RETURN_TIMESTAMP(get_hist_last_reset());
 }
+
+Datum
+query_histogram_metric(PG_FUNCTION_ARGS)
+{
+	FuncCallContext *funcctx;
+	TupleDesc	   tupdesc;
+	metric_data*   data;
+
+	/* init on the first call */
+	if (SRF_IS_FIRSTCALL()) {
+
+		MemoryContext oldcontext;
+
+		funcctx = SRF_FIRSTCALL_INIT();
+		oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+
+		data = query_hist_get_metric_data(text_to_cstring(PG_GETARG_TEXT_PP(0)),
+										  PG_GETARG_BOOL(1));
+
+		funcctx->user_fctx = data;
+		funcctx->max_calls = data->bins_count + 1;
+
+		/* Build a tuple descriptor for our result type */
+		if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+			ereport(ERROR,
+					(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+					 errmsg("function returning record called in context "
+							"that cannot accept type record")));
+
+		funcctx->tuple_desc = BlessTupleDesc(tupdesc);
+
+		/* switch back to the old context */
+		MemoryContextSwitchTo(oldcontext);
+
+	}
+
+	/* init the context */
+	funcctx = SRF_PERCALL_SETUP();
+
+	/* check if we have more data */
+	if (funcctx->max_calls > funcctx->call_cntr)
+	{
+		HeapTuple	   tuple;
+		Datum		   result;
+		Datum		   values[8];
+		bool			nulls[8];
+
+		int binIdx;
+
+		binIdx = funcctx->call_cntr;
+
+		data = (metric_data*)funcctx->user_fctx;
+
+		memset(nulls, 0, sizeof(nulls));
+
+		/* the first bin is [0, unit), then [unit * 2^(i-1), unit * 2^i) */
+		if (binIdx == 0) {
+			values[0] = Float8GetDatum(0);
+		} else {
+			values[0] = Float8GetDatum(ldexp(data->unit, binIdx-1));
+		}
+
+		if (funcctx->max_calls - 1 == funcctx->call_cntr) {
+			values[1] = Float8GetDatum(0);
+			nulls[1] = true;
+		} else {
+			values[1] = Float8GetDatum(ldexp(data->unit, binIdx));
+		}
+
+		values[2] = Int64GetDatum(data->count_data[binIdx]);
+
+		if (data->total_count > 0) {
+			values[3] = Float4GetDatum(100.0*data->count_data[binIdx] / data->total_count);
+		} else {
+			values[3] = Float4GetDatum(0);
+		}
+
+		values[4] = Float8GetDatum(data->value_data[binIdx]);
+
+		if (data->total_value > 0) {
+			values[5] = Float4GetDatum(100*data->value_data[binIdx] / data->total_value);
+		} else {
+			values[5] = Float4GetDatum(0);
+		}
+
+		values[6] = Float8GetDatum(data->time_data[binIdx]);
+
+		if (data->total_time > 0) {
+			values[7] = Float4GetDatum(100*data->time_data[binIdx] / data->total_time);
+		} else {
+			values[7] = Float4GetDatum(0);
+		}
+
+		/* Build and return the tuple. */
+		tuple = heap_form_tuple(funcctx->tuple_desc, values, nulls);
+
+		/* make the tuple into a datum */
+		result = HeapTupleGetDatum(tuple);
+
+		/* Here we want to return another item: */
+		SRF_RETURN_NEXT(funcctx, result);
+
+	}
+	else
+	{
+		/* Here we are done returning items and just need to clean up: */
+		SRF_RETURN_DONE(funcctx);
+	}
+
+}
+
+/* state of the query_histogram_heatmap SRF */
+typedef struct heatmap_fctx {
+
+	heatmap_data * data;
+
+	/* indexes of the non-empty cells (time * HEATMAP_BINS + rows) */
+	int * cells;
+
+} heatmap_fctx;
+
+/*
+ * Returns the non-empty cells of the duration / rows heatmap. The bins are
+ * logarithmic, bin 0 is for zero and bin i for [2^(i-1), 2^i) - the
+ * duration is collected in microseconds, but returned in miliseconds.
+ */
+Datum
+query_histogram_heatmap(PG_FUNCTION_ARGS)
+{
+	FuncCallContext *funcctx;
+	TupleDesc	   tupdesc;
+	heatmap_fctx*  fctx;
+
+	/* init on the first call */
+	if (SRF_IS_FIRSTCALL()) {
+
+		MemoryContext oldcontext;
+		int i, j;
+
+		funcctx = SRF_FIRSTCALL_INIT();
+		oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+
+		fctx = (heatmap_fctx *) palloc(sizeof(heatmap_fctx));
+		fctx->data = query_hist_get_heatmap_data(PG_GETARG_BOOL(0));
+		fctx->cells = (int *) palloc(sizeof(int) * HEATMAP_BINS * HEATMAP_BINS);
+
+		funcctx->user_fctx = fctx;
+		funcctx->max_calls = 0;
+
+		/* the heatmap is sparse, so remember just the non-empty cells */
+		for (i = 0; i < HEATMAP_BINS; i++) {
+			for (j = 0; j < HEATMAP_BINS; j++) {
+				if (fctx->data->counts[i][j] > 0)
+					fctx->cells[funcctx->max_calls++] = i * HEATMAP_BINS + j;
+			}
+		}
+
+		/* Build a tuple descriptor for our result type */
+		if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+			ereport(ERROR,
+					(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+					 errmsg("function returning record called in context "
+							"that cannot accept type record")));
+
+		funcctx->tuple_desc = BlessTupleDesc(tupdesc);
+
+		/* switch back to the old context */
+		MemoryContextSwitchTo(oldcontext);
+
+	}
+
+	/* init the context */
+	funcctx = SRF_PERCALL_SETUP();
+
+	/* check if we have more data */
+	if (funcctx->max_calls > funcctx->call_cntr)
+	{
+		HeapTuple	   tuple;
+		Datum		   result;
+		Datum		   values[5];
+		bool			nulls[5];
+
+		int timeIdx, rowsIdx;
+
+		fctx = (heatmap_fctx*)funcctx->user_fctx;
+
+		timeIdx = fctx->cells[funcctx->call_cntr] / HEATMAP_BINS;
+		rowsIdx = fctx->cells[funcctx->call_cntr] % HEATMAP_BINS;
+
+		memset(nulls, 0, sizeof(nulls));
+
+		values[0] = Float8GetDatum((timeIdx == 0) ? 0 : ldexp(1.0, timeIdx-1) / 1000.0);
+
+		if (timeIdx == HEATMAP_BINS - 1) {
+			values[1] = Float8GetDatum(0);
+			nulls[1] = true;
+		} else {
+			values[1] = Float8GetDatum(ldexp(1.0, timeIdx) / 1000.0);
+		}
+
+		values[2] = Int64GetDatum((rowsIdx == 0) ? 0 : ((int64) 1 << (rowsIdx-1)));
+
+		if (rowsIdx == HEATMAP_BINS - 1) {
+			values[3] = Int64GetDatum(0);
+			nulls[3] = true;
+		} else {
+			values[3] = Int64GetDatum((int64) 1 << rowsIdx);
+		}
+
+		values[4] = Int64GetDatum(fctx->data->counts[timeIdx][rowsIdx]);
+
+		/* Build and return the tuple. */
+		tuple = heap_form_tuple(funcctx->tuple_desc, values, nulls);
+
+		/* make the tuple into a datum */
+		result = HeapTupleGetDatum(tuple);
+
+		/* Here we want to return another item: */
+		SRF_RETURN_NEXT(funcctx, result);
+
+	}
+	else
+	{
+		/* Here we are done returning items and just need to clean up: */
+		SRF_RETURN_DONE(funcctx);
+	}
+
+}
+
+/* state of the query_histogram_plans SRF */
+typedef struct plans_fctx {
+
+	plan_histogram_data * data;
+	int nplans;
+
+	/* next plan / bin to look at */
+	int plan;
+	int bin;
+
+} plans_fctx;
+
+/*
+ * Returns the non-empty bins of the per-plan histograms, i.e. one row for
+ * each (queryid, planid, bin). The bins are logarithmic, in miliseconds.
+ */
+Datum
+query_histogram_plans(PG_FUNCTION_ARGS)
+{
+	FuncCallContext *funcctx;
+	TupleDesc	   tupdesc;
+	plans_fctx*	   fctx;
+
+	/* init on the first call */
+	if (SRF_IS_FIRSTCALL()) {
+
+		MemoryContext oldcontext;
+
+		funcctx = SRF_FIRSTCALL_INIT();
+		oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+
+		fctx = (plans_fctx *) palloc0(sizeof(plans_fctx));
+		fctx->data = query_hist_get_plans_data(PG_GETARG_BOOL(0), &(fctx->nplans));
+
+		funcctx->user_fctx = fctx;
+
+		/* Build a tuple descriptor for our result type */
+		if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+			ereport(ERROR,
+					(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+					 errmsg("function returning record called in context "
+							"that cannot accept type record")));
+
+		funcctx->tuple_desc = BlessTupleDesc(tupdesc);
+
+		/* switch back to the old context */
+		MemoryContextSwitchTo(oldcontext);
+
+	}
+
+	/* init the context */
+	funcctx = SRF_PERCALL_SETUP();
+
+	fctx = (plans_fctx*)funcctx->user_fctx;
+
+	/* skip the empty bins */
+	while ((fctx->plan < fctx->nplans) &&
+		   (fctx->data[fctx->plan].count_bins[fctx->bin] == 0)) {
+		if (++(fctx->bin) == PLAN_BINS) {
+			fctx->bin = 0;
+			fctx->plan++;
+		}
+	}
+
+	/* check if we have more data */
+	if (fctx->plan < fctx->nplans)
+	{
+		HeapTuple	   tuple;
+		Datum		   result;
+		Datum		   values[7];
+		bool			nulls[7];
+
+		plan_histogram_data *plan = &(fctx->data[fctx->plan]);
+		int binIdx = fctx->bin;
+
+		memset(nulls, 0, sizeof(nulls));
+
+		values[0] = ObjectIdGetDatum(plan->dbid);
+		values[1] = Int64GetDatum((int64) plan->queryid);
+		values[2] = Int64GetDatum((int64) plan->planid);
+
+		values[3] = Float8GetDatum((binIdx == 0) ? 0 : ldexp(1.0, binIdx-1) / 1000.0);
+
+		if (binIdx == PLAN_BINS - 1) {
+			values[4] = Float8GetDatum(0);
+			nulls[4] = true;
+		} else {
+			values[4] = Float8GetDatum(ldexp(1.0, binIdx) / 1000.0);
+		}
+
+		values[5] = Int64GetDatum(plan->count_bins[binIdx]);
+		values[6] = Float8GetDatum(plan->time_bins[binIdx]);
+
+		/* move to the next bin */
+		if (++(fctx->bin) == PLAN_BINS) {
+			fctx->bin = 0;
+			fctx->plan++;
+		}
+
+		/* Build and return the tuple. */
+		tuple = heap_form_tuple(funcctx->tuple_desc, values, nulls);
+
+		/* make the tuple into a datum */
+		result = HeapTupleGetDatum(tuple);
+
+		/* Here we want to return another item: */
+		SRF_RETURN_NEXT(funcctx, result);
+
+	}
+	else
+	{
+		/* Here we are done returning items and just need to clean up: */
+		SRF_RETURN_DONE(funcctx);
+	}
+
+}
+
+/* state of the query_histogram_nodes SRF */
+typedef struct nodes_fctx {
+
+	node_histogram_t * data;
+
+	/* next node type / bin to look at */
+	int node;
+	int bin;
+
+} nodes_fctx;
+
+/*
+ * Returns the non-empty bins of the per-node-type histograms (exclusive
+ * time of the node type in a query). The bins are logarithmic, in
+ * miliseconds.
+ */
+Datum
+query_histogram_nodes(PG_FUNCTION_ARGS)
+{
+	FuncCallContext *funcctx;
+	TupleDesc	   tupdesc;
+	nodes_fctx*	   fctx;
+
+	/* init on the first call */
+	if (SRF_IS_FIRSTCALL()) {
+
+		MemoryContext oldcontext;
+
+		funcctx = SRF_FIRSTCALL_INIT();
+		oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+
+		fctx = (nodes_fctx *) palloc0(sizeof(nodes_fctx));
+		fctx->data = query_hist_get_node_data(PG_GETARG_BOOL(0));
+
+		funcctx->user_fctx = fctx;
+
+		/* Build a tuple descriptor for our result type */
+		if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+			ereport(ERROR,
+					(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+					 errmsg("function returning record called in context "
+							"that cannot accept type record")));
+
+		funcctx->tuple_desc = BlessTupleDesc(tupdesc);
+
+		/* switch back to the old context */
+		MemoryContextSwitchTo(oldcontext);
+
+	}
+
+	/* init the context */
+	funcctx = SRF_PERCALL_SETUP();
+
+	fctx = (nodes_fctx*)funcctx->user_fctx;
+
+	/* skip the empty bins (the used node types are at the beginning) */
+	while ((fctx->node < NODE_TYPES_MAX) && (fctx->data[fctx->node].tag != T_Invalid) &&
+		   (fctx->data[fctx->node].count_bins[fctx->bin] == 0)) {
+		if (++(fctx->bin) == NODE_BINS) {
+			fctx->bin = 0;
+			fctx->node++;
+		}
+	}
+
+	/* check if we have more data */
+	if ((fctx->node < NODE_TYPES_MAX) && (fctx->data[fctx->node].tag != T_Invalid))
+	{
+		HeapTuple	   tuple;
+		Datum		   result;
+		Datum		   values[5];
+		bool			nulls[5];
+
+		node_histogram_t *node = &(fctx->data[fctx->node]);
+		int binIdx = fctx->bin;
+
+		memset(nulls, 0, sizeof(nulls));
+
+		values[0] = CStringGetTextDatum(query_hist_node_name(node->tag));
+
+		values[1] = Float8GetDatum((binIdx == 0) ? 0 : ldexp(1.0, binIdx-1) / 1000.0);
+
+		if (binIdx == NODE_BINS - 1) {
+			values[2] = Float8GetDatum(0);
+			nulls[2] = true;
+		} else {
+			values[2] = Float8GetDatum(ldexp(1.0, binIdx) / 1000.0);
+		}
+
+		values[3] = Int64GetDatum(node->count_bins[binIdx]);
+		values[4] = Float8GetDatum(node->time_bins[binIdx]);
+
+		/* move to the next bin */
+		if (++(fctx->bin) == NODE_BINS) {
+			fctx->bin = 0;
+			fctx->node++;
+		}
+
+		/* Build and return the tuple. */
+		tuple = heap_form_tuple(funcctx->tuple_desc, values, nulls);
+
+		/* make the tuple into a datum */
+		result = HeapTupleGetDatum(tuple);
+
+		/* Here we want to return another item: */
+		SRF_RETURN_NEXT(funcctx, result);
+
+	}
+	else
+	{
+		/* Here we are done returning items and just need to clean up: */
+		SRF_RETURN_DONE(funcctx);
+	}
+
+}
+
+/* state of the query_histogram_waits SRF */
+typedef struct waits_fctx {
+
+	wait_histogram_t * data;
+
+	/* next wait event / bin to look at */
+	int wait;
+	int bin;
+
+} waits_fctx;
+
+/*
+ * Histograms of wait durations by wait event (only the non-empty bins),
+ * the bins are logarithmic in microseconds (but returned in miliseconds).
+ */
+Datum
+query_histogram_waits(PG_FUNCTION_ARGS)
+{
+	FuncCallContext *funcctx;
+	TupleDesc	   tupdesc;
+	waits_fctx*	   fctx;
+
+	/* init on the first call */
+	if (SRF_IS_FIRSTCALL()) {
+
+		MemoryContext oldcontext;
+
+		funcctx = SRF_FIRSTCALL_INIT();
+		oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+
+		fctx = (waits_fctx *) palloc0(sizeof(waits_fctx));
+		fctx->data = query_hist_get_wait_data();
+
+		funcctx->user_fctx = fctx;
+
+		/* Build a tuple descriptor for our result type */
+		if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+			ereport(ERROR,
+					(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+					 errmsg("function returning record called in context "
+							"that cannot accept type record")));
+
+		funcctx->tuple_desc = BlessTupleDesc(tupdesc);
+
+		/* switch back to the old context */
+		MemoryContextSwitchTo(oldcontext);
+
+	}
+
+	/* init the context */
+	funcctx = SRF_PERCALL_SETUP();
+
+	fctx = (waits_fctx*)funcctx->user_fctx;
+
+	/* skip the empty bins (the used wait events are at the beginning) */
+	while ((fctx->wait < WAIT_EVENTS_MAX) && (fctx->data[fctx->wait].wait_event_info != 0) &&
+		   (fctx->data[fctx->wait].count_bins[fctx->bin] == 0)) {
+		if (++(fctx->bin) == WAIT_BINS) {
+			fctx->bin = 0;
+			fctx->wait++;
+		}
+	}
+
+	/* check if we have more data */
+	if ((fctx->wait < WAIT_EVENTS_MAX) && (fctx->data[fctx->wait].wait_event_info != 0))
+	{
+		HeapTuple	   tuple;
+		Datum		   result;
+		Datum		   values[6];
+		bool			nulls[6];
+
+		wait_histogram_t *wait = &(fctx->data[fctx->wait]);
+		int binIdx = fctx->bin;
+		const char *name;
+
+		memset(nulls, 0, sizeof(nulls));
+
+		name = pgstat_get_wait_event_type(wait->wait_event_info);
+		if (name)
+			values[0] = CStringGetTextDatum(name);
+		else
+			nulls[0] = true;
+
+		name = pgstat_get_wait_event(wait->wait_event_info);
+		if (name)
+			values[1] = CStringGetTextDatum(name);
+		else
+			nulls[1] = true;
+
+		values[2] = Float8GetDatum((binIdx == 0) ? 0 : ldexp(1.0, binIdx-1) / 1000.0);
+
+		if (binIdx == WAIT_BINS - 1) {
+			values[3] = Float8GetDatum(0);
+			nulls[3] = true;
+		} else {
+			values[3] = Float8GetDatum(ldexp(1.0, binIdx) / 1000.0);
+		}
+
+		values[4] = Int64GetDatum(wait->count_bins[binIdx]);
+		values[5] = Float8GetDatum(wait->time_bins[binIdx]);
+
+		/* move to the next bin */
+		if (++(fctx->bin) == WAIT_BINS) {
+			fctx->bin = 0;
+			fctx->wait++;
+		}
+
+		/* Build and return the tuple. */
+		tuple = heap_form_tuple(funcctx->tuple_desc, values, nulls);
+
+		/* make the tuple into a datum */
+		result = HeapTupleGetDatum(tuple);
+
+		/* Here we want to return another item: */
+		SRF_RETURN_NEXT(funcctx, result);
+
+	}
+	else
+	{
+		/* Here we are done returning items and just need to clean up: */
+		SRF_RETURN_DONE(funcctx);
+	}
+
+}
+
+/* state of the query_histogram_concurrency SRF */
+typedef struct concurrency_fctx {
+
+	concurrency_data * data;
+
+	/* indexes of the non-empty cells (time * CONCURRENCY_BINS + concurrency) */
+	int * cells;
+
+} concurrency_fctx;
+
+/*
+ * Returns the non-empty cells of the duration / concurrency histogram. The
+ * bins are logarithmic, just like for the heatmap (the duration is returned
+ * in miliseconds).
+ */
+Datum
+query_histogram_concurrency(PG_FUNCTION_ARGS)
+{
+	FuncCallContext *funcctx;
+	TupleDesc	   tupdesc;
+	concurrency_fctx*  fctx;
+
+	/* init on the first call */
+	if (SRF_IS_FIRSTCALL()) {
+
+		MemoryContext oldcontext;
+		int i, j;
+
+		funcctx = SRF_FIRSTCALL_INIT();
+		oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+
+		fctx = (concurrency_fctx *) palloc(sizeof(concurrency_fctx));
+		fctx->data = query_hist_get_concurrency_data(PG_GETARG_BOOL(0));
+		fctx->cells = (int *) palloc(sizeof(int) * HEATMAP_BINS * CONCURRENCY_BINS);
+
+		funcctx->user_fctx = fctx;
+		funcctx->max_calls = 0;
+
+		/* the histogram is sparse, so remember just the non-empty cells */
+		for (i = 0; i < HEATMAP_BINS; i++) {
+			for (j = 0; j < CONCURRENCY_BINS; j++) {
+				if (fctx->data->counts[i][j] > 0)
+					fctx->cells[funcctx->max_calls++] = i * CONCURRENCY_BINS + j;
+			}
+		}
+
+		/* Build a tuple descriptor for our result type */
+		if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+			ereport(ERROR,
+					(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+					 errmsg("function returning record called in context "
+							"that cannot accept type record")));
+
+		funcctx->tuple_desc = BlessTupleDesc(tupdesc);
+
+		/* switch back to the old context */
+		MemoryContextSwitchTo(oldcontext);
+
+	}
+
+	/* init the context */
+	funcctx = SRF_PERCALL_SETUP();
+
+	/* check if we have more data */
+	if (funcctx->max_calls > funcctx->call_cntr)
+	{
+		HeapTuple	   tuple;
+		Datum		   result;
+		Datum		   values[5];
+		bool			nulls[5];
+
+		int timeIdx, concurrencyIdx;
+
+		fctx = (concurrency_fctx*)funcctx->user_fctx;
+
+		timeIdx = fctx->cells[funcctx->call_cntr] / CONCURRENCY_BINS;
+		concurrencyIdx = fctx->cells[funcctx->call_cntr] % CONCURRENCY_BINS;
+
+		memset(nulls, 0, sizeof(nulls));
+
+		values[0] = Float8GetDatum((timeIdx == 0) ? 0 : ldexp(1.0, timeIdx-1) / 1000.0);
+
+		if (timeIdx == HEATMAP_BINS - 1) {
+			values[1] = Float8GetDatum(0);
+			nulls[1] = true;
+		} else {
+			values[1] = Float8GetDatum(ldexp(1.0, timeIdx) / 1000.0);
+		}
+
+		values[2] = Int32GetDatum((concurrencyIdx == 0) ? 0 : (1 << (concurrencyIdx-1)));
+
+		if (concurrencyIdx == CONCURRENCY_BINS - 1) {
+			values[3] = Int32GetDatum(0);
+			nulls[3] = true;
+		} else {
+			values[3] = Int32GetDatum(1 << concurrencyIdx);
+		}
+
+		values[4] = Int64GetDatum(fctx->data->counts[timeIdx][concurrencyIdx]);
+
+		/* Build and return the tuple. */
+		tuple = heap_form_tuple(funcctx->tuple_desc, values, nulls);
+
+		/* make the tuple into a datum */
+		result = HeapTupleGetDatum(tuple);
+
+		/* Here we want to return another item: */
+		SRF_RETURN_NEXT(funcctx, result);
+
+	}
+	else
+	{
+		/* Here we are done returning items and just need to clean up: */
+		SRF_RETURN_DONE(funcctx);
+	}
+
+}
+
+/* state of the query_histogram_slowest SRF */
+typedef struct slowest_fctx {
+
+	slow_query_t * data;
+	int nqueries;
+
+} slowest_fctx;
+
+/* Returns the slowest statements (in no particular order). */
+Datum
+query_histogram_slowest(PG_FUNCTION_ARGS)
+{
+	FuncCallContext *funcctx;
+	TupleDesc	   tupdesc;
+	slowest_fctx*  fctx;
+
+	/* init on the first call */
+	if (SRF_IS_FIRSTCALL()) {
+
+		MemoryContext oldcontext;
+
+		funcctx = SRF_FIRSTCALL_INIT();
+		oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+
+		fctx = (slowest_fctx *) palloc0(sizeof(slowest_fctx));
+		fctx->data = query_hist_get_slowest_data(&(fctx->nqueries));
+
+		funcctx->user_fctx = fctx;
+		funcctx->max_calls = fctx->nqueries;
+
+		/* Build a tuple descriptor for our result type */
+		if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+			ereport(ERROR,
+					(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+					 errmsg("function returning record called in context "
+							"that cannot accept type record")));
+
+		funcctx->tuple_desc = BlessTupleDesc(tupdesc);
+
+		/* switch back to the old context */
+		MemoryContextSwitchTo(oldcontext);
+
+	}
+
+	/* init the context */
+	funcctx = SRF_PERCALL_SETUP();
+
+	/* check if we have more data */
+	if (funcctx->max_calls > funcctx->call_cntr)
+	{
+		HeapTuple	   tuple;
+		Datum		   result;
+		Datum		   values[6];
+		bool			nulls[6];
+
+		slow_query_t *query;
+
+		fctx = (slowest_fctx*)funcctx->user_fctx;
+		query = &(fctx->data[funcctx->call_cntr]);
+
+		memset(nulls, 0, sizeof(nulls));
+
+		values[0] = Int64GetDatum((int64) query->queryid);
+		values[1] = ObjectIdGetDatum(query->dbid);
+		values[2] = ObjectIdGetDatum(query->userid);
+		values[3] = Float8GetDatum(query->duration * 1000.0);
+		values[4] = TimestampTzGetDatum(query->timestamp);
+		values[5] = CStringGetTextDatum(query->query);
+
+		/* Build and return the tuple. */
+		tuple = heap_form_tuple(funcctx->tuple_desc, values, nulls);
+
+		/* make the tuple into a datum */
+		result = HeapTupleGetDatum(tuple);
+
+		/* Here we want to return another item: */
+		SRF_RETURN_NEXT(funcctx, result);
+
+	}
+	else
+	{
+		/* Here we are done returning items and just need to clean up: */
+		SRF_RETURN_DONE(funcctx);
+	}
+
+}
+
+/* state of the query_histogram_captured_plans SRF */
+typedef struct captured_plans_fctx {
+
+	captured_plan_t * data;
+	int nplans;
+
+} captured_plans_fctx;
+
+/* Returns the captured plans (in no particular order). */
+Datum
+query_histogram_captured_plans(PG_FUNCTION_ARGS)
+{
+	FuncCallContext *funcctx;
+	TupleDesc	   tupdesc;
+	captured_plans_fctx*  fctx;
+
+	/* init on the first call */
+	if (SRF_IS_FIRSTCALL()) {
+
+		MemoryContext oldcontext;
+
+		funcctx = SRF_FIRSTCALL_INIT();
+		oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+
+		fctx = (captured_plans_fctx *) palloc0(sizeof(captured_plans_fctx));
+		fctx->data = query_hist_get_captured_plans(&(fctx->nplans));
+
+		funcctx->user_fctx = fctx;
+		funcctx->max_calls = fctx->nplans;
+
+		/* Build a tuple descriptor for our result type */
+		if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+			ereport(ERROR,
+					(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+					 errmsg("function returning record called in context "
+							"that cannot accept type record")));
+
+		funcctx->tuple_desc = BlessTupleDesc(tupdesc);
+
+		/* switch back to the old context */
+		MemoryContextSwitchTo(oldcontext);
+
+	}
+
+	/* init the context */
+	funcctx = SRF_PERCALL_SETUP();
+
+	/* check if we have more data */
+	if (funcctx->max_calls > funcctx->call_cntr)
+	{
+		HeapTuple	   tuple;
+		Datum		   result;
+		Datum		   values[5];
+		bool			nulls[5];
+
+		captured_plan_t *plan;
+
+		fctx = (captured_plans_fctx*)funcctx->user_fctx;
+		plan = &(fctx->data[funcctx->call_cntr]);
+
+		memset(nulls, 0, sizeof(nulls));
+
+		values[0] = Int64GetDatum((int64) plan->queryid);
+		values[1] = ObjectIdGetDatum(plan->dbid);
+		values[2] = Float8GetDatum(plan->duration * 1000.0);
+		values[3] = TimestampTzGetDatum(plan->timestamp);
+		values[4] = CStringGetTextDatum(plan->plan);
+
+		/* Build and return the tuple. */
+		tuple = heap_form_tuple(funcctx->tuple_desc, values, nulls);
+
+		/* make the tuple into a datum */
+		result = HeapTupleGetDatum(tuple);
+
+		/* Here we want to return another item: */
+		SRF_RETURN_NEXT(funcctx, result);
+
+	}
+	else
+	{
+		/* Here we are done returning items and just need to clean up: */
+		SRF_RETURN_DONE(funcctx);
+	}
+
+}
+
+/* estimated total time (in ms) from the sampled times (in ns) */
+static double
+internal_total_time(uint64 time, uint64 samples, uint64 count)
+{
+	if (samples == 0)
+		return 0;
+
+	return (time / 1000000.0) * ((double) count / samples);
+}
+
+/* Returns the counters of the extension's own overhead (a single row). */
+Datum
+query_histogram_internal_stats(PG_FUNCTION_ARGS)
+{
+	TupleDesc	   tupdesc;
+	HeapTuple	   tuple;
+	Datum		   values[8];
+	bool		   nulls[8];
+	internal_stats_t *stats;
+
+	/* Build a tuple descriptor for our result type */
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("function returning record called in context "
+						"that cannot accept type record")));
+
+	tupdesc = BlessTupleDesc(tupdesc);
+
+	stats = query_hist_get_internal_stats();
+
+	memset(nulls, 0, sizeof(nulls));
+
+	values[0] = Int64GetDatum(stats->recorded);
+	values[1] = Int64GetDatum(stats->skipped);
+	values[2] = Int64GetDatum(stats->lock_acquisitions);
+	values[3] = Int64GetDatum(stats->lock_wait_samples);
+	values[4] = Float8GetDatum(internal_total_time(stats->lock_wait_time,
+												   stats->lock_wait_samples,
+												   stats->lock_acquisitions));
+	values[5] = Int64GetDatum(stats->hook_calls);
+	values[6] = Int64GetDatum(stats->hook_samples);
+	values[7] = Float8GetDatum(internal_total_time(stats->hook_time,
+												   stats->hook_samples,
+												   stats->hook_calls));
+
+	tuple = heap_form_tuple(tupdesc, values, nulls);
+
+	PG_RETURN_DATUM(HeapTupleGetDatum(tuple));
+}
+
+/* the clocks, in the same order as timing_method_t */
+static const char * clock_names[] = {"instr", "coarse", "tsc"};
+
+#define CLOCK_COUNT		3
+
+/* state of the query_histogram_clock_bench SRF */
+typedef struct clock_bench_fctx {
+
+	int loops;
+
+} clock_bench_fctx;
+
+/* Measures the cost of reading each of the clocks (one row per clock). */
+Datum
+query_histogram_clock_bench(PG_FUNCTION_ARGS)
+{
+	FuncCallContext *funcctx;
+	TupleDesc	   tupdesc;
+	clock_bench_fctx*  fctx;
+
+	/* init on the first call */
+	if (SRF_IS_FIRSTCALL()) {
+
+		MemoryContext oldcontext;
+
+		funcctx = SRF_FIRSTCALL_INIT();
+		oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+
+		if (PG_GETARG_INT32(0) <= 0)
+			ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("number of loops has to be positive")));
+
+		fctx = (clock_bench_fctx *) palloc0(sizeof(clock_bench_fctx));
+		fctx->loops = PG_GETARG_INT32(0);
+
+		funcctx->user_fctx = fctx;
+		funcctx->max_calls = CLOCK_COUNT;
+
+		/* Build a tuple descriptor for our result type */
+		if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+			ereport(ERROR,
+					(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+					 errmsg("function returning record called in context "
+							"that cannot accept type record")));
+
+		funcctx->tuple_desc = BlessTupleDesc(tupdesc);
+
+		/* switch back to the old context */
+		MemoryContextSwitchTo(oldcontext);
+
+	}
+
+	/* init the context */
+	funcctx = SRF_PERCALL_SETUP();
+
+	/* check if we have more data */
+	if (funcctx->max_calls > funcctx->call_cntr)
+	{
+		HeapTuple	   tuple;
+		Datum		   result;
+		Datum		   values[5];
+		bool			nulls[5];
+
+		int			method = funcctx->call_cntr;
+		double		cost;
+
+		fctx = (clock_bench_fctx*)funcctx->user_fctx;
+
+		memset(nulls, 0, sizeof(nulls));
+
+		cost = query_hist_clock_bench(method, fctx->loops);
+
+		values[0] = CStringGetTextDatum(clock_names[method]);
+		values[1] = BoolGetDatum(cost >= 0);
+		values[2] = BoolGetDatum(method == query_histogram_timing_method);
+
+		/* per-call cost and resolution in nanoseconds */
+		if (cost >= 0) {
+			values[3] = Float8GetDatum(cost * 1000000000.0);
+			values[4] = Float8GetDatum(query_hist_clock_resolution(method) * 1000000000.0);
+		} else {
+			nulls[3] = true;
+			nulls[4] = true;
+		}
+
+		/* Build and return the tuple. */
+		tuple = heap_form_tuple(funcctx->tuple_desc, values, nulls);
+
+		/* make the tuple into a datum */
+		result = HeapTupleGetDatum(tuple);
+
+		/* Here we want to return another item: */
+		SRF_RETURN_NEXT(funcctx, result);
+
+	}
+	else
+	{
+		/* Here we are done returning items and just need to clean up: */
+		SRF_RETURN_DONE(funcctx);
+	}
+
+}
+
+/*
+ * Estimates a percentile of the query duration from the histogram (in ms),
+ * with a confidence interval reflecting the sampling (a single row).
+ */
+Datum
+query_histogram_percentile(PG_FUNCTION_ARGS)
+{
+	TupleDesc	   tupdesc;
+	HeapTuple	   tuple;
+	Datum		   values[4];
+	bool		   nulls[4];
+	histogram_data *data;
+	double		   fraction = PG_GETARG_FLOAT8(0);
+	double		   confidence = PG_GETARG_FLOAT8(1);
+	double		   value, low, high;
+	count_bin_t	   sampled = 0;
+	int			   i;
+
+	if ((fraction < 0) || (fraction > 1))
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("percentile %g is not between 0 and 1", fraction)));
+
+	if ((confidence <= 0) || (confidence >= 1))
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("confidence %g is not between 0 and 1", confidence)));
+
+	/* Build a tuple descriptor for our result type */
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("function returning record called in context "
+						"that cannot accept type record")));
+
+	tupdesc = BlessTupleDesc(tupdesc);
+
+	data = query_hist_get_data(true);
+
+	memset(nulls, 0, sizeof(nulls));
+
+	if ((data->bins_count > 0) &&
+		query_hist_percentile(data, fraction, confidence, &value, &low, &high)) {
+
+		values[0] = Float8GetDatum(value);
+		values[1] = Float8GetDatum(low);
+		values[2] = Float8GetDatum(high);
+
+	} else {
+		nulls[0] = nulls[1] = nulls[2] = true;
+	}
+
+	/* number of recorded queries the estimate is based on */
+	for (i = 0; (data->bins_count > 0) && (i <= data->bins_count); i++)
+		sampled += data->sample_data[i];
+
+	values[3] = Int64GetDatum(sampled);
+
+	tuple = heap_form_tuple(tupdesc, values, nulls);
+
+	PG_RETURN_DATUM(HeapTupleGetDatum(tuple));
+}
@@ -1,5 +1,8 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <math.h>
+#include <time.h>
+#include <sys/resource.h>
 #include <sys/shm.h>
 #include <sys/stat.h>
 
@@ -8,17 +11,48 @@
 
 #include "postgres.h"
 #include "miscadmin.h"
+#include "access/xact.h"
+#include "access/xlog.h"
 #include "storage/ipc.h"
 #include "storage/fd.h"
 #include "storage/shmem.h"
 
 #include "commands/explain.h"
+#if (PG_VERSION_NUM >= 180000)
+#include "commands/explain_format.h"
+#include "commands/explain_state.h"
+#endif
 #include "executor/executor.h"
 #include "executor/instrument.h"
+#if (PG_VERSION_NUM >= 110000)
+#include "jit/jit.h"
+#endif
+#include "libpq/auth.h"
+#include "libpq/libpq-be.h"
+#include "utils/builtins.h"
 #include "utils/guc.h"
 #include "tcop/utility.h"
 
+#if (PG_VERSION_NUM >= 100000)
+#include "utils/varlena.h"
+#endif
+
+#if (PG_VERSION_NUM >= 120000)
+#include "port/pg_bitutils.h"
+#endif
+
+#if (PG_VERSION_NUM >= 100000)
 #include "common/md5.h"
+#else
+#include "libpq/md5.h"
+#endif
+#include "mb/pg_wchar.h"
+#include "pgstat.h"
+#include "port/atomics.h"
+
+#if (PG_VERSION_NUM >= 180000)
+#include "utils/pgstat_internal.h"
+#endif
 
 #include "queryhist.h"
 
@@ -29,13 +63,25 @@ static const struct config_enum_entry histogram_type_options[] = {
 	{NULL, 0, false}
 };
 
+/* clock used to measure the durations */
+static const struct config_enum_entry timing_method_options[] = {
+	{"instr", TIMING_INSTR, false},
+	{"coarse", TIMING_COARSE, false},
+	{"tsc", TIMING_TSC, false},
+	{NULL, 0, false}
+};
+
 static int nesting_level = 0;
 
 /* private functions */
+static void histogram_shmem_request(void);
 static void histogram_shmem_startup(void);
-static void histogram_shmem_shutdown(int code, Datum arg);
 
+#if (PG_VERSION_NUM < 180000)
+static void histogram_shmem_shutdown(int code, Datum arg);
 static void histogram_load_from_file(void);
+static bool histogram_md5(const void *data, size_t len, char *hash);
+#endif
 
 static void set_histogram_bins_count_hook(int newval, void *extra);
 static void set_histogram_bins_width_hook(int newval, void *extra);
@@ -52,11 +98,135 @@ static const char * show_histogram_track_utility(void);
 /* return from a hook */
 #define HOOK_RETURN(a)	return;
 
-static void query_hist_add_query(time_bin_t duration);
+/* InstrAlloc got the async_mode parameter in 14 */
+#if (PG_VERSION_NUM >= 140000)
+#define HISTOGRAM_INSTR_ALLOC(options)	InstrAlloc(1, (options), false)
+#else
+#define HISTOGRAM_INSTR_ALLOC(options)	InstrAlloc(1, (options))
+#endif
+
+static bool query_hist_sample(void);
+static int query_hist_add_sample(histogram_sample_t * sample);
+static bool query_hist_is_tail_bin(int bin);
+static int query_hist_add_query(time_bin_t duration);
+static void query_hist_set_exemplar(int bin, histogram_sample_t * sample);
+static void query_hist_add_event(int metric, double seconds);
+static void query_hist_add_metric(metric_histogram_t * hist, int metric,
+								  double value, time_bin_t duration);
 static bool query_histogram_enabled(void);
-static int get_hist_bin(int bins, int step, time_bin_t duration);
+static int get_hist_bin(int type, int bins, int step, time_bin_t duration);
+static int get_metric_bin(double unit, double value);
+static int get_metric_by_name(const char * name);
+
+static void histogram_collect_metrics(QueryDesc *queryDesc, histogram_sample_t * sample);
+
+/* State of a sampled top-level query, allocated in the per-query memory
+ * context. The queries are tracked in a backend-local list (there may
+ * be multiple queries executed at the same time, e.g. with cursors), and
+ * the entries are removed by a reset callback of the memory context, so
+ * that we don't leave dangling entries behind after an error. */
+typedef struct histogram_query_t {
+
+	QueryDesc  *queryDesc;
+
+	/* CPU time (in miliseconds) consumed in ExecutorRun / ExecutorFinish */
+	bool		track_cpu;
+	double		cpu_time;
+
+	/* per-node instrumentation enabled (see node_sample_pct) */
+	bool		track_nodes;
+
+	/* duration (in seconds) measured by our own clock (timing_method),
+	 * instead of the timer in totaltime - the method is read just once in
+	 * ExecutorStart, so that all the readings use the same clock */
+	bool		own_clock;
+	int			timing_method;
+	double		elapsed;
+
+	/* wrapper of the DestReceiver (time to the first row), or NULL */
+	histogram_dest_t *dest;
+
+	/* number of active backends when the query started (-1 if not known) */
+	int			concurrency;
+
+	MemoryContextCallback callback;
+	struct histogram_query_t *next;
+
+} histogram_query_t;
+
+static histogram_query_t * histogram_queries = NULL;
+
+static histogram_query_t * histogram_start_query(QueryDesc *queryDesc);
+static double histogram_query_duration(QueryDesc *queryDesc, histogram_query_t *query);
+static histogram_query_t * histogram_find_query(QueryDesc *queryDesc);
+static void histogram_release_query(void *arg);
+
+static double get_cpu_time(void);
 
+/* Number of backends running a top-level query (see query_histogram.concurrency),
+ * in a separate shared segment. Each backend counts itself only once, even if
+ * it has multiple queries running (cursors), and the queries are tracked with
+ * a memory context callback so that the counter is decremented even when the
+ * query fails. */
+static pg_atomic_uint32 * shared_active_backends = NULL;
+static int backend_active_queries = 0;
+
+static void histogram_active_shmem_startup(void);
+
+/* Exemplars for the bins of the histogram, in a separate shared segment
+ * (updated without locking, and not persisted). */
+static histogram_exemplar_t * shared_exemplars = NULL;
+static int histogram_active_start(QueryDesc *queryDesc);
+static void histogram_active_end(void *arg);
+
+static void histogram_xact_callback(XactEvent event, void *arg);
+
+/* start of the commit (in the pre-commit callback), and whether the
+ * transaction wrote any WAL (i.e. whether the commit has to flush it and
+ * possibly wait for synchronous replicas) */
+static bool commit_timing = false;
+static bool commit_wrote_wal = false;
+static instr_time commit_start;
+
+static void histogram_statement_start(void);
+static void histogram_statement_end(void);
+
+/* end of the last top-level statement, if it left a transaction open (the
+ * flag is cleared at commit / abort) */
+static bool idle_xact_timing = false;
+static instr_time idle_xact_start;
+
+static void histogram_client_auth(Port *port, int status);
+static void histogram_session_end(int code, Datum arg);
+
+#if (PG_VERSION_NUM < 180000)
+/*
+ * The events (commits, idle-in-transaction periods, sessions) are recorded
+ * for all transactions, not just a sample, so taking the exclusive lock for
+ * each of them would serialize all the commits in the cluster. Instead they
+ * are accumulated in a backend-local histogram, and merged into the shared
+ * one after EVENTS_FLUSH_COUNT events or EVENTS_FLUSH_INTERVAL ms (if the
+ * lock is not available right away, we just try again with the next event),
+ * and when the backend exits. Since 18 the pending histogram does this.
+ */
+#define EVENTS_FLUSH_COUNT		64
+#define EVENTS_FLUSH_INTERVAL	1000
+
+static metric_histogram_t pending_events[METRIC_COUNT];
+static int pending_events_count = 0;
+static instr_time pending_events_start;
+static bool pending_events_registered = false;
+
+static void histogram_events_flush(bool nowait);
+static void histogram_events_exit(int code, Datum arg);
+#endif
+
+static bool check_histogram_metrics(char **newval, void **extra, GucSource source);
+static void assign_histogram_metrics(const char *newval, void *extra);
+
+#if (PG_VERSION_NUM < 180000)
 static size_t get_histogram_size(void);
+#endif
 
 /* The histogram itself is stored in a shared memory segment
  * with this layout (see the histogram_info_t below).
@@ -82,9 +252,49 @@ static int  default_histogram_step = 100;
 static int  default_histogram_sample_pct = 5;
 static int  default_histogram_type = HISTOGRAM_LINEAR;
 
+static char *default_histogram_metrics = NULL;
+static bool default_histogram_heatmap = false;
+static bool default_histogram_concurrency = false;
+static bool default_histogram_exemplar_text = false;
+static int  default_histogram_plan_capture_bins = 0;
+static double default_histogram_node_sample_pct = 0;
+
 /* set at the end of init */
 static bool histogram_is_dynamic = true;
 
+/* bitmap of the enabled metrics (from query_histogram.metrics) */
+static uint32 histogram_metrics = 0;
+
+/* names of the metrics (as used in query_histogram.metrics), the upper
+ * boundary of the first bin (i.e. the resolution of the histogram) and
+ * whether the values are sampled (and need to be scaled) or not */
+typedef struct metric_info_t {
+	const char *name;
+	double		unit;
+	bool		sampled;
+} metric_info_t;
+
+static const metric_info_t metric_info[METRIC_COUNT] = {
+	{"shared_blks_read", 1.0, true},		/* blocks */
+	{"shared_blks_hit", 1.0, true},			/* blocks */
+	{"temp_blks_written", 1.0, true},		/* blocks */
+	{"wal_bytes", 1.0, true},				/* bytes */
+	{"io_time", 0.001, true},				/* miliseconds */
+	{"cpu_time", 0.001, true},				/* miliseconds */
+	{"cpu_ratio", 1.0/1024, true},			/* CPU time / duration */
+	{"memory", 1.0, true},					/* kilobytes */
+	{"jit_time", 0.001, true},				/* miliseconds */
+	{"cost_ratio", 1.0/1048576, true},		/* miliseconds per cost unit */
+	{"rows_qerror", 1.0, true},				/* max(estimate/actual, actual/estimate) */
+	{"first_row_time", 0.001, true},		/* miliseconds */
+	{"send_time", 0.001, true},				/* miliseconds */
+	{"exec_time", 0.001, true},				/* miliseconds (duration - send_time) */
+	{"commit_wal_time", 0.001, false},		/* miliseconds (commits that wrote WAL) */
+	{"commit_nowal_time", 0.001, false},	/* miliseconds (commits without WAL) */
+	{"idle_xact_time", 0.001, false},		/* miliseconds (between statements) */
+	{"session_time", 0.001, false}			/* miliseconds (session lifetime) */
+};
+
 /* TODO It might be useful to allow 'per database' histograms, or to collect
  *	  the data only for some of the databases. So there might be options
  *
@@ -96,39 +306,164 @@ static bool histogram_is_dynamic = true;
  */
 
 /* Saved hook values in case of unload */
+#if (PG_VERSION_NUM >= 150000)
+static shmem_request_hook_type prev_shmem_request_hook = NULL;
+#endif
 static shmem_startup_hook_type prev_shmem_startup_hook = NULL;
 static ExecutorStart_hook_type prev_ExecutorStart = NULL;
 static ExecutorRun_hook_type prev_ExecutorRun = NULL;
 static ExecutorEnd_hook_type prev_ExecutorEnd = NULL;
 static ProcessUtility_hook_type prev_ProcessUtility = NULL;
+static ClientAuthentication_hook_type prev_ClientAuthentication = NULL;
 
 void		_PG_init(void);
 void		_PG_fini(void);
 
 static void histogram_ExecutorStart(QueryDesc *queryDesc, int eflags);
+#if (PG_VERSION_NUM >= 100000) && (PG_VERSION_NUM < 180000)
+static void histogram_ExecutorRun(QueryDesc *queryDesc,
+					ScanDirection direction,
+					uint64 count, bool execute_once);
+#else
 static void histogram_ExecutorRun(QueryDesc *queryDesc,
 					ScanDirection direction,
 					uint64 count);
+#endif
 static void histogram_ExecutorEnd(QueryDesc *queryDesc);
 
-#if (PG_VERSION_NUM >= 90300)
+/* ProcessUtility API changed in 10, 13 and 14 */
+#if (PG_VERSION_NUM >= 140000)
+static void queryhist_ProcessUtility(PlannedStmt *pstmt, const char *queryString,
+									 bool readOnlyTree,
+									 ProcessUtilityContext context,
+									 ParamListInfo params, QueryEnvironment *queryEnv,
+									 DestReceiver *dest, QueryCompletion *qc);
+
+#define PROCESS_UTILITY_ARGS	pstmt, queryString, readOnlyTree, context, params, \
+								queryEnv, dest, qc
+#elif (PG_VERSION_NUM >= 130000)
+static void queryhist_ProcessUtility(PlannedStmt *pstmt, const char *queryString,
+									 ProcessUtilityContext context,
+									 ParamListInfo params, QueryEnvironment *queryEnv,
+									 DestReceiver *dest, QueryCompletion *qc);
+
+#define PROCESS_UTILITY_ARGS	pstmt, queryString, context, params, \
+								queryEnv, dest, qc
+#elif (PG_VERSION_NUM >= 100000)
+static void queryhist_ProcessUtility(PlannedStmt *pstmt, const char *queryString,
+									 ProcessUtilityContext context,
+									 ParamListInfo params, QueryEnvironment *queryEnv,
+									 DestReceiver *dest, char *completionTag);
+
+#define PROCESS_UTILITY_ARGS	pstmt, queryString, context, params, \
+								queryEnv, dest, completionTag
+#else
 static void queryhist_ProcessUtility(Node *parsetree, const char *queryString,
 									 ProcessUtilityContext context,
 									 ParamListInfo params, DestReceiver *dest,
 									 char *completionTag);
-#else
-static void queryhist_ProcessUtility(Node *parsetree,
-									 const char *queryString, ParamListInfo params,
-									 bool isTopLevel, DestReceiver *dest,
-									 char *completionTag);
+
+#define PROCESS_UTILITY_ARGS	parsetree, queryString, context, params, \
+								dest, completionTag
 #endif
 
 static ExecutorFinish_hook_type prev_ExecutorFinish = NULL;
 static void histogram_ExecutorFinish(QueryDesc *queryDesc);
 
+#if (PG_VERSION_NUM >= 170000)
+static ExplainOneQuery_hook_type prev_ExplainOneQuery = NULL;
+static void histogram_ExplainOneQuery(Query *query, int cursorOptions,
+									  IntoClause *into, ExplainState *es,
+									  const char *queryString, ParamListInfo params,
+									  QueryEnvironment *queryEnv);
+static void histogram_explain_rank(ExplainState *es);
+#endif
+
+/*
+ * Query executed by EXPLAIN ANALYZE - the nesting level of the query (-1 if
+ * there's no EXPLAIN ANALYZE running), and the duration and queryId of the
+ * query (duration -1 until the query completes).
+ */
+static int explain_nesting_level = -1;
+static double explain_duration = -1;
+static uint64 explain_queryid = 0;
+
 /* the whole histogram (info and data) */
 static histogram_info_t * shared_histogram_info = NULL;
 
+#if (PG_VERSION_NUM >= 180000)
+/*
+ * Since 18 the histogram is stored as a custom (fixed-numbered) cumulative
+ * statistics kind, so pgstat allocates the shared memory, writes the data
+ * to disk on clean shutdown (and throws them away after a crash), and
+ * handles resets. The kind ID should be reserved on the wiki page
+ * (https://wiki.postgresql.org/wiki/CustomCumulativeStats).
+ *
+ * The queries are not added to the shared histogram directly - each backend
+ * accumulates them in a local (pending) histogram, which is then flushed by
+ * pgstat_report_stat() at most once a second, so the lock is acquired once
+ * per flush and not once per query.
+ */
+#define PGSTAT_KIND_QUERY_HISTOGRAM		PGSTAT_KIND_EXPERIMENTAL
+
+/* The lock is embedded in the shared struct, and it's not part of the
+ * data written to disk (the persisted data start at info.last_reset,
+ * so the info.lock pointer is not overwritten when restoring the data). */
+typedef struct histogram_shared_t {
+	LWLock			 lock;
+	int				 tranche_id;	/* of the lock, so that the waits show as "query_histogram" */
+	histogram_info_t info;
+} histogram_shared_t;
+
+#define HISTOGRAM_SHARED_DATA_OFF	offsetof(histogram_shared_t, info.last_reset)
+
+/* backend-local part of the histogram, not flushed to shared memory yet */
+typedef struct histogram_pending_t {
+
+	bool has_data;
+
+	/* layout of the histogram the pending data were collected with */
+	int  type;
+	int  bins;
+	int  step;
+
+	count_bin_t count_bins[HIST_BINS_MAX+1];
+	time_bin_t  time_bins[HIST_BINS_MAX+1];
+
+	metric_histogram_t metrics[METRIC_COUNT];
+
+	count_bin_t heatmap[HEATMAP_BINS][HEATMAP_BINS];
+
+	count_bin_t concurrency[HEATMAP_BINS][CONCURRENCY_BINS];
+
+	node_histogram_t nodes[NODE_TYPES_MAX];
+
+} histogram_pending_t;
+
+static histogram_pending_t pending_histogram;
+
+static void histogram_stats_init_shmem(void *stats);
+static bool histogram_stats_flush(bool nowait);
+static void histogram_stats_reset_all(TimestampTz ts);
+static void histogram_stats_snapshot(void);
+
+static const PgStat_KindInfo histogram_stats_kind = {
+	.name = "query_histogram",
+
+	.fixed_amount = true,
+	.write_to_file = true,
+
+	.shared_size = sizeof(histogram_shared_t),
+	.shared_data_off = HISTOGRAM_SHARED_DATA_OFF,
+	.shared_data_len = sizeof(histogram_shared_t) - HISTOGRAM_SHARED_DATA_OFF,
+
+	.init_shmem_cb = histogram_stats_init_shmem,
+	.flush_static_cb = histogram_stats_flush,
+	.reset_all_cb = histogram_stats_reset_all,
+	.snapshot_cb = histogram_stats_snapshot,
+};
+#endif
+
 /*
  * Module load callback
  */
@@ -219,17 +554,174 @@ _PG_init(void)
 							 &set_histogram_type_hook,
 							 &show_histogram_type_hook);
 
+	DefineCustomEnumVariable("query_histogram.timing_method",
+							 "Clock used to measure the durations.",
+							 "instr uses the executor instrumentation, coarse is cheaper but less precise, "
+							 "tsc uses the CPU time-stamp counter.",
+							 &query_histogram_timing_method,
+							 TIMING_INSTR,
+							 timing_method_options,
+							 PGC_SUSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomStringVariable("query_histogram.metrics",
+							   "List of additional metrics collected into separate histograms.",
+							   "Allowed values are shared_blks_read, shared_blks_hit, "
+							   "temp_blks_written, wal_bytes, io_time, cpu_time, "
+							   "cpu_ratio, memory, jit_time, cost_ratio, "
+							   "rows_qerror, first_row_time, send_time, "
+							   "exec_time, commit_wal_time, commit_nowal_time, "
+							   "idle_xact_time, session_time and all.",
+							   &default_histogram_metrics,
+							   "",
+							   PGC_SUSET,
+							   GUC_LIST_INPUT,
+							   &check_histogram_metrics,
+							   &assign_histogram_metrics,
+							   NULL);
+
+	DefineCustomBoolVariable("query_histogram.heatmap",
+							 "Selects whether the duration / rows heatmap is collected.",
+							 NULL,
+							 &default_histogram_heatmap,
+							 false,
+							 PGC_SUSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomBoolVariable("query_histogram.concurrency",
+							 "Selects whether the duration / concurrency histogram is collected.",
+							 NULL,
+							 &default_histogram_concurrency,
+							 false,
+							 PGC_SUSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomBoolVariable("query_histogram.exemplar_text",
+							 "Selects whether the exemplars include the (truncated) query text.",
+							 NULL,
+							 &default_histogram_exemplar_text,
+							 false,
+							 PGC_SUSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomRealVariable("query_histogram.node_sample_pct",
+							 "Sets the portion of sampled queries with per-node instrumentation (in percent).",
+							 "Zero disables collecting the per-node-type histograms.",
+							 &default_histogram_node_sample_pct,
+							 0.0,
+							 0.0, 100.0,
+							 PGC_SUSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomIntVariable("query_histogram.max_plans",
+							"Sets the maximum number of per-plan histograms.",
+							"Zero disables collecting the per-plan histograms.",
+							&query_histogram_max_plans,
+							0,
+							0, 100000,
+							PGC_POSTMASTER,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("query_histogram.slowest_count",
+							"Sets the number of slowest statements to keep.",
+							"Zero disables capturing the slowest statements.",
+							&query_histogram_slowest_count,
+							0,
+							0, 10000,
+							PGC_POSTMASTER,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("query_histogram.plan_capture_size",
+							"Sets the number of captured plans of the slowest queries.",
+							"Zero disables capturing the plans.",
+							&query_histogram_plan_capture_size,
+							0,
+							0, 1000,
+							PGC_POSTMASTER,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("query_histogram.plan_capture_bins",
+							"Sets the number of the last bins whose queries get the plan captured.",
+							"Zero means only the overflow bin.",
+							&default_histogram_plan_capture_bins,
+							0,
+							0, 1000,
+							PGC_SUSET,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("query_histogram.plan_capture_interval",
+							"Sets the minimum interval between plan captures of the same query.",
+							NULL,
+							&query_histogram_plan_capture_interval,
+							60,
+							0, INT_MAX / 1000,
+							PGC_SUSET,
+							GUC_UNIT_S,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("query_histogram.wait_sample_rate",
+							"Sets how many times per second the wait events are sampled.",
+							"Zero disables the wait event sampling.",
+							&query_histogram_wait_sample_rate,
+							0,
+							0, 1000,
+							PGC_POSTMASTER,
+							0,
+							query_hist_waits_check_rate,
+							NULL,
+							NULL);
+
+#if (PG_VERSION_NUM >= 150000)
+	MarkGUCPrefixReserved("query_histogram");
+#else
 	EmitWarningsOnPlaceholders("query_histogram");
+#endif
 
+#if (PG_VERSION_NUM >= 180000)
 	/*
-	 * Request additional shared resources.  (These are no-ops if we're not in
-	 * the postmaster process.)  We'll allocate or attach to the shared
-	 * resources in histogram_shmem_startup().
+	 * The shared memory (and the lock) is allocated by pgstat, we'll only
+	 * attach to it in histogram_shmem_startup().
 	 */
-	RequestAddinShmemSpace(get_histogram_size());
-	RequestNamedLWLockTranche("query_histogram", 1);
+	pgstat_register_kind(PGSTAT_KIND_QUERY_HISTOGRAM, &histogram_stats_kind);
+#endif
 
 	/* Install hooks. */
+#if (PG_VERSION_NUM >= 150000)
+	prev_shmem_request_hook = shmem_request_hook;
+	shmem_request_hook = histogram_shmem_request;
+#else
+	histogram_shmem_request();
+#endif
+
 	prev_shmem_startup_hook = shmem_startup_hook;
 	shmem_startup_hook = histogram_shmem_startup;
 
@@ -243,6 +735,22 @@ _PG_init(void)
 	ExecutorEnd_hook = histogram_ExecutorEnd;
 	prev_ProcessUtility = ProcessUtility_hook;
 	ProcessUtility_hook = queryhist_ProcessUtility;
+
+	prev_ClientAuthentication = ClientAuthentication_hook;
+	ClientAuthentication_hook = histogram_client_auth;
+
+#if (PG_VERSION_NUM >= 170000)
+	prev_ExplainOneQuery = ExplainOneQuery_hook;
+	ExplainOneQuery_hook = histogram_ExplainOneQuery;
+#endif
+
+	RegisterXactCallback(histogram_xact_callback, NULL);
+
+	query_hist_waits_register_worker();
+
+	/* calibrate the TSC once in the postmaster (the backends inherit it) */
+	if (query_histogram_timing_method == TIMING_TSC)
+		query_hist_clock_calibrate();
 }
 
 
@@ -257,7 +765,14 @@ _PG_fini(void)
 	ExecutorRun_hook = prev_ExecutorRun;
 	ExecutorFinish_hook = prev_ExecutorFinish;
 	ExecutorEnd_hook = prev_ExecutorEnd;
+	ProcessUtility_hook = prev_ProcessUtility;
 	shmem_startup_hook = prev_shmem_startup_hook;
+	ClientAuthentication_hook = prev_ClientAuthentication;
+#if (PG_VERSION_NUM >= 170000)
+	ExplainOneQuery_hook = prev_ExplainOneQuery;
+#endif
+
+	UnregisterXactCallback(histogram_xact_callback, NULL);
 }
 
 /*
@@ -266,15 +781,66 @@ _PG_fini(void)
 static void
 histogram_ExecutorStart(QueryDesc *queryDesc, int eflags)
 {
+	/* Enable the histogram whenever the histogram is dynamic or (bins>0),
+	 * and decide right away whether to sample the (top-level) query, so
+	 * that the instrumentation is needed only for the sampled ones. */
+	bool	sampled;
+	bool	track_nodes = false;
+	int		concurrency = -1;
+	int		timing_method = query_histogram_timing_method;
+	hook_timer_t timer;
+
+	query_hist_timer_start(&timer);
+
+	if (nesting_level == 0)
+		histogram_statement_start();
+
+	sampled = ((nesting_level == 0) && query_histogram_enabled() && query_hist_sample());
+
+	if ((nesting_level == 0) && query_histogram_enabled())
+		query_hist_internal_statement(sampled);
+
+	/* The per-node instrumentation has to be requested before the plan
+	 * state is initialized, and it's expensive, so only for a sub-sample
+	 * of the sampled queries. */
+	if (sampled && (default_histogram_node_sample_pct > 0) &&
+		((double) rand() / RAND_MAX * 100.0 < default_histogram_node_sample_pct))
+	{
+		queryDesc->instrument_options |= INSTRUMENT_TIMER;
+		track_nodes = true;
+	}
+
+	query_hist_timer_pause(&timer);
 
 	if (prev_ExecutorStart)
 		prev_ExecutorStart(queryDesc, eflags);
 	else
 		standard_ExecutorStart(queryDesc, eflags);
 
-	/* Enable the histogram whenever the histogram is dynamic or (bins>0). */
-	if (query_histogram_enabled())
+	query_hist_timer_resume(&timer);
+
+	/* the active backends have to be counted for all queries */
+	if ((nesting_level == 0) && default_histogram_concurrency && query_histogram_enabled())
+		concurrency = histogram_active_start(queryDesc);
+
+	/* the slowest statements need the duration of all top-level queries
+	 * (but just the timer, the rest is needed only for sampled queries),
+	 * and so does the query executed by EXPLAIN ANALYZE */
+	if ((! sampled) && (queryDesc->totaltime == NULL) &&
+		(((nesting_level == 0) && (query_histogram_slowest_count > 0) && query_histogram_enabled()) ||
+		 (nesting_level == explain_nesting_level)))
 	{
+		MemoryContext oldcxt;
+
+		oldcxt = MemoryContextSwitchTo(queryDesc->estate->es_query_cxt);
+		queryDesc->totaltime = HISTOGRAM_INSTR_ALLOC(INSTRUMENT_TIMER);
+		MemoryContextSwitchTo(oldcxt);
+	}
+
+	if (sampled)
+	{
+		histogram_query_t *query;
+
 		/*
 		 * Set up to track total elapsed time in ExecutorRun.  Make sure the
 		 * space is allocated in the per-query context so it will go away at
@@ -283,35 +849,93 @@ histogram_ExecutorStart(QueryDesc *queryDesc, int eflags)
 		if (queryDesc->totaltime == NULL)
 		{
 			MemoryContext oldcxt;
+			int		options = INSTRUMENT_ALL;
+
+			/* with our own clock, the timer is just an overhead */
+			if (timing_method != TIMING_INSTR)
+				options &= ~INSTRUMENT_TIMER;
 
 			oldcxt = MemoryContextSwitchTo(queryDesc->estate->es_query_cxt);
-			queryDesc->totaltime = InstrAlloc(1, INSTRUMENT_ALL);
+			queryDesc->totaltime = HISTOGRAM_INSTR_ALLOC(options);
 			MemoryContextSwitchTo(oldcxt);
 		}
+
+		query = histogram_start_query(queryDesc);
+
+		query->own_clock = (timing_method != TIMING_INSTR);
+		query->timing_method = timing_method;
+
+		/* the CPU time requires syscalls, so only when actually needed */
+		query->track_cpu = ((histogram_metrics & ((1 << METRIC_CPU_TIME) | (1 << METRIC_CPU_RATIO))) != 0);
+		query->track_nodes = track_nodes;
+		query->concurrency = concurrency;
+
+		/* the receiver itself is wrapped in ExecutorRun */
+		if (histogram_metrics & ((1 << METRIC_FIRST_ROW_TIME) | (1 << METRIC_SEND_TIME) | (1 << METRIC_EXEC_TIME)))
+			query->dest = query_hist_dest_create(queryDesc->estate->es_query_cxt,
+												 (histogram_metrics & ((1 << METRIC_SEND_TIME) | (1 << METRIC_EXEC_TIME))) != 0,
+												 timing_method);
 	}
+
+	query_hist_timer_stop(&timer);
 }
 
 /*
  * ExecutorRun hook: all we need do is track nesting depth
  */
 static void
+#if (PG_VERSION_NUM >= 100000) && (PG_VERSION_NUM < 180000)
+histogram_ExecutorRun(QueryDesc *queryDesc, ScanDirection direction, uint64 count,
+					  bool execute_once)
+#else
 histogram_ExecutorRun(QueryDesc *queryDesc, ScanDirection direction, uint64 count)
+#endif
 {
+	histogram_query_t *query = histogram_find_query(queryDesc);
+	DestReceiver *dest = queryDesc->dest;
+	double		cpu_start = 0;
+	double		start = 0;
+
+	if (query && query->track_cpu)
+		cpu_start = get_cpu_time();
+
+	if (query && query->own_clock)
+		start = query_hist_clock_read(query->timing_method);
+
+	/* wrap the receiver set by the portal for this run */
+	if (query && query->dest)
+		queryDesc->dest = query_hist_dest_wrap(query->dest, dest);
+
 	nesting_level++;
 	PG_TRY();
 	{
+#if (PG_VERSION_NUM >= 100000) && (PG_VERSION_NUM < 180000)
+		if (prev_ExecutorRun)
+			prev_ExecutorRun(queryDesc, direction, count, execute_once);
+		else
+			standard_ExecutorRun(queryDesc, direction, count, execute_once);
+#else
 		if (prev_ExecutorRun)
 			prev_ExecutorRun(queryDesc, direction, count);
 		else
 			standard_ExecutorRun(queryDesc, direction, count);
+#endif
 		nesting_level--;
+		queryDesc->dest = dest;
 	}
 	PG_CATCH();
 	{
 		nesting_level--;
+		queryDesc->dest = dest;
 		PG_RE_THROW();
 	}
 	PG_END_TRY();
+
+	if (query && query->own_clock)
+		query->elapsed += query_hist_clock_elapsed(query->timing_method, start);
+
+	if (query && query->track_cpu)
+		query->cpu_time += (get_cpu_time() - cpu_start);
 }
 
 /*
@@ -320,6 +944,16 @@ histogram_ExecutorRun(QueryDesc *queryDesc, ScanDirection direction, uint64 coun
 static void
 histogram_ExecutorFinish(QueryDesc *queryDesc)
 {
+	histogram_query_t *query = histogram_find_query(queryDesc);
+	double		cpu_start = 0;
+	double		start = 0;
+
+	if (query && query->track_cpu)
+		cpu_start = get_cpu_time();
+
+	if (query && query->own_clock)
+		start = query_hist_clock_read(query->timing_method);
+
 	nesting_level++;
 	PG_TRY();
 	{
@@ -335,6 +969,12 @@ histogram_ExecutorFinish(QueryDesc *queryDesc)
 		PG_RE_THROW();
 	}
 	PG_END_TRY();
+
+	if (query && query->own_clock)
+		query->elapsed += query_hist_clock_elapsed(query->timing_method, start);
+
+	if (query && query->track_cpu)
+		query->cpu_time += (get_cpu_time() - cpu_start);
 }
 
 /*
@@ -343,95 +983,622 @@ histogram_ExecutorFinish(QueryDesc *queryDesc)
 static void
 histogram_ExecutorEnd(QueryDesc *queryDesc)
 {
-	if (queryDesc->totaltime && (nesting_level == 0) && query_histogram_enabled())
+	histogram_query_t *query;
+	hook_timer_t timer;
+
+	query_hist_timer_start(&timer);
+
+	query = histogram_find_query(queryDesc);
+
+	/* only sampled queries have the state (see histogram_ExecutorStart) */
+	if (query && queryDesc->totaltime)
 	{
+		histogram_sample_t sample;
 		float seconds;
+		int bin;
 
-		/*
-		 * Make sure stats accumulation is done.  (Note: it's okay if several
-		 * levels of hook all do this.)
-		 */
-		InstrEndLoop(queryDesc->totaltime);
+		seconds = histogram_query_duration(queryDesc, query);
 
-		/* Log plan if duration is exceeded. */
-		seconds = queryDesc->totaltime->total;
+		sample.duration = seconds;
+		sample.rows = (default_histogram_heatmap) ? queryDesc->estate->es_processed : -1;
+		sample.concurrency = query->concurrency;
+		sample.queryid = (uint64) queryDesc->plannedstmt->queryId;
+		sample.query = queryDesc->sourceText;
+		histogram_collect_metrics(queryDesc, &sample);
 
-		/* is the histogram static or dynamic? */
-		if (! default_histogram_dynamic) {
+		/* the metrics might have been enabled since the query started */
+		if (query->track_cpu) {
+			sample.values[METRIC_CPU_TIME] = query->cpu_time;
+			sample.values[METRIC_CPU_RATIO] = (seconds > 0) ? (query->cpu_time / (seconds * 1000.0)) : 0;
+		} else {
+			sample.metrics &= ~((1 << METRIC_CPU_TIME) | (1 << METRIC_CPU_RATIO));
+		}
 
-			/* in case of static histogram, it's quite simple - check the number
-			 * of bins and a sample rate - then lock the segment, add the query
-			 * and unlock it again */
-			if ((default_histogram_bins > 0) && (rand() % 100 <  default_histogram_sample_pct)) {
-				LWLockAcquire(shared_histogram_info->lock, LW_EXCLUSIVE);
-				query_hist_add_query(seconds);
-				LWLockRelease(shared_histogram_info->lock);
-			}
+		/* time to the first row (only if there was one) */
+		if (query->dest && (query_hist_dest_first_row(query->dest) >= 0))
+			sample.values[METRIC_FIRST_ROW_TIME] = query_hist_dest_first_row(query->dest) * 1000.0;
+		else
+			sample.metrics &= ~(1 << METRIC_FIRST_ROW_TIME);
 
-		} else {
-			/* when the histogram is dynamic, we have to lock it first, as we
-			 * will access the sample_pct in the histogram */
-			LWLockAcquire(shared_histogram_info->lock, LW_SHARED);
-			if ((shared_histogram_info->bins > 0) && (rand() % 100 <  shared_histogram_info->sample_pct)) {
-				LWLockRelease(shared_histogram_info->lock);
-				LWLockAcquire(shared_histogram_info->lock, LW_EXCLUSIVE);
-				query_hist_add_query(seconds);
-			}
-			LWLockRelease(shared_histogram_info->lock);
+		/* time sending the rows, and the "pure" execution without it (the
+		 * send time is estimated, so make sure it's not above the duration) */
+		if (query->dest) {
+			double send_time = Min(query_hist_dest_send_time(query->dest), seconds);
 
+			sample.values[METRIC_SEND_TIME] = send_time * 1000.0;
+			sample.values[METRIC_EXEC_TIME] = (seconds - send_time) * 1000.0;
+		} else {
+			sample.metrics &= ~((1 << METRIC_SEND_TIME) | (1 << METRIC_EXEC_TIME));
 		}
 
+		if (query->track_nodes)
+			query_hist_collect_node_times(queryDesc->planstate, &sample);
+		else
+			sample.nnodes = 0;
+
+		bin = query_hist_add_sample(&sample);
+
+		/* plans of the queries in the last bins (before the planstate
+		 * goes away in standard_ExecutorEnd) */
+		if ((query_histogram_plan_capture_size > 0) && query_hist_is_tail_bin(bin))
+			query_hist_capture_plan(queryDesc, query->track_nodes, seconds);
+
+		/* per-plan histogram (the plan hash is not computed otherwise) */
+		if (query_histogram_max_plans > 0)
+			query_hist_plans_add(queryDesc->plannedstmt, seconds);
+	}
+
+	/* the statement may be one of the slowest ones (sampled or not) */
+	if ((nesting_level == 0) && (query_histogram_slowest_count > 0) &&
+		queryDesc->totaltime && query_histogram_enabled())
+	{
+		query_hist_slowest_add((uint64) queryDesc->plannedstmt->queryId,
+							   (queryDesc->sourceText) ? queryDesc->sourceText : "",
+							   histogram_query_duration(queryDesc, query));
+	}
+
+	/* remember the duration of the query executed by EXPLAIN ANALYZE */
+	if ((nesting_level == explain_nesting_level) && queryDesc->totaltime)
+	{
+		explain_duration = histogram_query_duration(queryDesc, query);
+		explain_queryid = (uint64) queryDesc->plannedstmt->queryId;
 	}
 
+	query_hist_timer_stop(&timer);
+
 	if (prev_ExecutorEnd)
 		prev_ExecutorEnd(queryDesc);
 	else
 		standard_ExecutorEnd(queryDesc);
 
+	if (nesting_level == 0)
+		histogram_statement_end();
 }
 
+#if (PG_VERSION_NUM >= 170000)
 /*
- * ProcessUtility hook (API changed in 9.3)
+ * ExplainOneQuery hook: for EXPLAIN ANALYZE, add the rank of the query in
+ * the histogram (the histogram of the queryId if there's one, the overall
+ * histogram otherwise), so that it's clear whether it was a typical run.
+ *
+ * Only for the text format - the line is added after the whole output of
+ * the query, and for the other formats the output is already closed.
  */
 static void
-#if (PG_VERSION_NUM >= 90300)
-queryhist_ProcessUtility(Node *parsetree, const char *queryString,
-						 ProcessUtilityContext context, ParamListInfo params,
-						 DestReceiver *dest, char *completionTag)
-#else
-queryhist_ProcessUtility(Node *parsetree, const char *queryString,
-						 ParamListInfo params, bool isTopLevel,
-						 DestReceiver *dest, char *completionTag)
-#endif
+histogram_ExplainOneQuery(Query *query, int cursorOptions,
+						  IntoClause *into, ExplainState *es,
+						  const char *queryString, ParamListInfo params,
+						  QueryEnvironment *queryEnv)
 {
-	if (default_histogram_utility && (nesting_level == 0) && query_histogram_enabled())
+	int		save_nesting_level = explain_nesting_level;
+
+	if (es->analyze && (es->format == EXPLAIN_FORMAT_TEXT))
 	{
-		/* collecting histogram is enabled, we're in top level (nesting_level=0) */
-		instr_time  start;
-		instr_time  duration;
-		float	   seconds;
+		explain_nesting_level = nesting_level;
+		explain_duration = -1;
+	}
+	else
+		explain_nesting_level = -1;
 
-		INSTR_TIME_SET_CURRENT(start);
+	PG_TRY();
+	{
+		if (prev_ExplainOneQuery)
+			prev_ExplainOneQuery(query, cursorOptions, into, es,
+								 queryString, params, queryEnv);
+		else
+			standard_ExplainOneQuery(query, cursorOptions, into, es,
+									 queryString, params, queryEnv);
+	}
+	PG_FINALLY();
+	{
+		explain_nesting_level = save_nesting_level;
+	}
+	PG_END_TRY();
+
+	if (es->analyze && (es->format == EXPLAIN_FORMAT_TEXT) && (explain_duration >= 0))
+		histogram_explain_rank(es);
+
+	explain_duration = -1;
+}
+
+/* percentage of queries faster than the bin, plus half of the bin */
+static double
+histogram_rank(count_bin_t *count_bins, int nbins, int bin, count_bin_t *total)
+{
+	int		i;
+	count_bin_t	below = 0;
+
+	*total = 0;
+	for (i = 0; i < nbins; i++)
+	{
+		*total += count_bins[i];
+
+		if (i < bin)
+			below += count_bins[i];
+	}
+
+	if (*total == 0)
+		return 0;
+
+	return 100.0 * (below + count_bins[bin] / 2.0) / (*total);
+}
+
+/* adds the "Histogram: pXX (bin ...)" line to the EXPLAIN output */
+static void
+histogram_explain_rank(ExplainState *es)
+{
+	count_bin_t	plan_bins[PLAN_BINS];
+	count_bin_t	total;
+	histogram_data *data;
+	double		rank;
+	double		bin_from,
+				bin_to;
+	int			bin;
+	char	   *line;
+
+	/* the histogram of the query itself (all plans), in microseconds */
+	if ((explain_queryid != 0) &&
+		query_hist_plans_query_data(explain_queryid, plan_bins))
+	{
+		bin = get_log2_bin((uint64) (explain_duration * 1000000.0), PLAN_BINS);
+		rank = histogram_rank(plan_bins, PLAN_BINS, bin, &total);
+
+		if (total == 0)
+			return;
+
+		bin_from = (bin == 0) ? 0 : ((uint64) 1 << (bin - 1)) / 1000.0;
+		bin_to = ((uint64) 1 << bin) / 1000.0;
+
+		if (bin == PLAN_BINS - 1)
+			line = psprintf("p%.1f (bin >= %g ms, queryid)", rank, bin_from);
+		else
+			line = psprintf("p%.1f (bin %g-%g ms, queryid)", rank, bin_from, bin_to);
+
+		ExplainPropertyText("Histogram", line, es);
+		return;
+	}
+
+	/* otherwise the overall histogram (in milliseconds) */
+	if (! shared_histogram_info)
+		return;
+
+	data = query_hist_get_data(false);
+
+	if ((data->bins_count == 0) || (data->total_count == 0))
+		return;
+
+	bin = get_hist_bin(data->histogram_type, data->bins_count,
+					   data->bins_width, explain_duration);
+	rank = histogram_rank(data->count_data, data->bins_count + 1, bin, &total);
+
+	bin_from = query_hist_bin_lower(data->histogram_type, data->bins_width, bin);
+	bin_to = query_hist_bin_upper(data->histogram_type, data->bins_width, bin);
+
+	if (bin == data->bins_count)
+		line = psprintf("p%.1f (bin >= %g ms)", rank, bin_from);
+	else
+		line = psprintf("p%.1f (bin %g-%g ms)", rank, bin_from, bin_to);
+
+	ExplainPropertyText("Histogram", line, es);
+}
+#endif
+
+/*
+ * Duration of the query (in seconds) - either from our own clock (sampled
+ * queries with timing_method other than instr), or from the totaltime.
+ */
+static double
+histogram_query_duration(QueryDesc *queryDesc, histogram_query_t *query)
+{
+	if (query && query->own_clock)
+		return query->elapsed;
+
+	/*
+	 * Make sure stats accumulation is done.  (Note: it's okay if several
+	 * levels of hook all do this.)
+	 */
+	InstrEndLoop(queryDesc->totaltime);
+
+	return queryDesc->totaltime->total;
+}
+
+/* Creates state for a sampled query (and adds it to the list of queries). */
+static histogram_query_t *
+histogram_start_query(QueryDesc *queryDesc)
+{
+	histogram_query_t *query;
+
+	query = (histogram_query_t *) MemoryContextAllocZero(queryDesc->estate->es_query_cxt,
+														 sizeof(histogram_query_t));
+
+	query->queryDesc = queryDesc;
+
+	/* remove the entry from the list when the query context goes away */
+	query->callback.func = histogram_release_query;
+	query->callback.arg = query;
+	MemoryContextRegisterResetCallback(queryDesc->estate->es_query_cxt,
+									   &(query->callback));
+
+	query->next = histogram_queries;
+	histogram_queries = query;
+
+	return query;
+}
+
+/* Returns state of the query, or NULL if the query is not sampled. */
+static histogram_query_t *
+histogram_find_query(QueryDesc *queryDesc)
+{
+	histogram_query_t *query;
+
+	for (query = histogram_queries; query != NULL; query = query->next) {
+		if (query->queryDesc == queryDesc)
+			return query;
+	}
+
+	return NULL;
+}
+
+/* Memory context callback, removes the query from the list. */
+static void
+histogram_release_query(void *arg)
+{
+	histogram_query_t **prev = &histogram_queries;
+
+	while (*prev != NULL) {
+		if (*prev == (histogram_query_t *) arg) {
+			*prev = (*prev)->next;
+			break;
+		}
+		prev = &((*prev)->next);
+	}
+}
+
+/*
+ * Transaction callback, measures the commit latency (from the pre-commit
+ * to the commit callback), which includes flushing the WAL and waiting for
+ * synchronous replicas. All commits are recorded (not just a sample), but
+ * into a backend-local histogram, merged into the shared one in batches
+ * (see query_hist_add_event), so this does not add a lock to each commit.
+ */
+static void
+histogram_xact_callback(XactEvent event, void *arg)
+{
+	switch (event)
+	{
+		case XACT_EVENT_PRE_COMMIT:
+
+			commit_timing = ((histogram_metrics & ((1 << METRIC_COMMIT_WAL_TIME) | (1 << METRIC_COMMIT_NOWAL_TIME))) != 0) &&
+							query_histogram_enabled();
+
+			if (commit_timing) {
+				/* XactLastRecEnd is reset by the commit itself */
+				commit_wrote_wal = (XactLastRecEnd != InvalidXLogRecPtr);
+				INSTR_TIME_SET_CURRENT(commit_start);
+			}
+			break;
+
+		case XACT_EVENT_COMMIT:
+
+			if (commit_timing) {
+				instr_time	duration;
+
+				INSTR_TIME_SET_CURRENT(duration);
+				INSTR_TIME_SUBTRACT(duration, commit_start);
+
+				query_hist_add_event(commit_wrote_wal ? METRIC_COMMIT_WAL_TIME : METRIC_COMMIT_NOWAL_TIME,
+									 INSTR_TIME_GET_DOUBLE(duration));
+			}
+
+			commit_timing = false;
+			idle_xact_timing = false;
+			break;
+
+		case XACT_EVENT_ABORT:
+		case XACT_EVENT_PREPARE:
+			commit_timing = false;
+			idle_xact_timing = false;
+			break;
+
+		default:
+			break;
+	}
+}
+
+/*
+ * Called at the start of each top-level statement, records the time since
+ * the end of the previous statement if the transaction was left open (i.e.
+ * the time the session spent "idle in transaction").
+ */
+static void
+histogram_statement_start(void)
+{
+	instr_time	duration;
+
+	if (! idle_xact_timing)
+		return;
+
+	idle_xact_timing = false;
+
+	INSTR_TIME_SET_CURRENT(duration);
+	INSTR_TIME_SUBTRACT(duration, idle_xact_start);
+
+	query_hist_add_event(METRIC_IDLE_XACT_TIME, INSTR_TIME_GET_DOUBLE(duration));
+}
+
+/*
+ * Called at the end of each top-level statement, starts measuring the idle
+ * time if we're in a transaction block (for implicit transactions the time
+ * between statements is not interesting, the transaction commits).
+ */
+static void
+histogram_statement_end(void)
+{
+	idle_xact_timing = ((histogram_metrics & (1 << METRIC_IDLE_XACT_TIME)) != 0) &&
+					   query_histogram_enabled() && IsTransactionBlock();
+
+	if (idle_xact_timing)
+		INSTR_TIME_SET_CURRENT(idle_xact_start);
+}
+
+/*
+ * Client authentication hook - this is the first place executed in each
+ * (client) backend, so register the callback recording the session
+ * lifetime here.
+ */
+static void
+histogram_client_auth(Port *port, int status)
+{
+	if (prev_ClientAuthentication)
+		prev_ClientAuthentication(port, status);
+
+	if (status == STATUS_OK)
+		before_shmem_exit(histogram_session_end, (Datum) 0);
+}
+
+/* before_shmem_exit callback, records the lifetime of the session - it's
+ * registered after pgstat's callback, so it runs before the final flush */
+static void
+histogram_session_end(int code, Datum arg)
+{
+	TimestampTz	start;
+	long		secs;
+	int			usecs;
+
+	if (! ((histogram_metrics & (1 << METRIC_SESSION_TIME)) && query_histogram_enabled()))
+		return;
+
+#if (PG_VERSION_NUM >= 110000)
+	start = MyStartTimestamp;
+#else
+	start = MyProcPort->SessionStartTime;
+#endif
+
+	TimestampDifference(start, GetCurrentTimestamp(), &secs, &usecs);
+
+	query_hist_add_event(METRIC_SESSION_TIME, secs + usecs / 1000000.0);
+
+#if (PG_VERSION_NUM < 180000)
+	histogram_events_flush(false);
+#endif
+}
+
+/*
+ * Counts the backend as active (unless it's already running another query),
+ * and returns the number of active backends (including this one). The
+ * backend is counted until the query memory context goes away.
+ */
+static int
+histogram_active_start(QueryDesc *queryDesc)
+{
+	MemoryContextCallback *callback;
+
+	callback = (MemoryContextCallback *) MemoryContextAlloc(queryDesc->estate->es_query_cxt,
+															sizeof(MemoryContextCallback));
+	callback->func = histogram_active_end;
+	callback->arg = NULL;
+	MemoryContextRegisterResetCallback(queryDesc->estate->es_query_cxt, callback);
+
+	if (backend_active_queries++ == 0)
+		return pg_atomic_add_fetch_u32(shared_active_backends, 1);
+
+	return pg_atomic_read_u32(shared_active_backends);
+}
+
+/* Memory context callback, stops counting the backend as active. */
+static void
+histogram_active_end(void *arg)
+{
+	if (--backend_active_queries == 0)
+		pg_atomic_sub_fetch_u32(shared_active_backends, 1);
+}
+
+/* CPU time (user + system) consumed by the backend, in miliseconds */
+static double
+get_cpu_time(void)
+{
+#ifdef CLOCK_THREAD_CPUTIME_ID
+	struct timespec ts;
+
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+
+	return (ts.tv_sec * 1000.0) + (ts.tv_nsec / 1000000.0);
+#else
+	struct rusage ru;
+
+	getrusage(RUSAGE_SELF, &ru);
+
+	return (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000.0 +
+		   (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1000.0;
+#endif
+}
+
+/*
+ * Collects the enabled metrics from the query instrumentation (which is
+ * set up with INSTRUMENT_ALL in histogram_ExecutorStart).
+ */
+static void
+histogram_collect_metrics(QueryDesc *queryDesc, histogram_sample_t * sample)
+{
+	Instrumentation *instr = queryDesc->totaltime;
+	instr_time		 io_time;
+
+	sample->metrics = histogram_metrics;
+
+	sample->values[METRIC_SHARED_BLKS_READ] = instr->bufusage.shared_blks_read;
+	sample->values[METRIC_SHARED_BLKS_HIT] = instr->bufusage.shared_blks_hit;
+	sample->values[METRIC_TEMP_BLKS_WRITTEN] = instr->bufusage.temp_blks_written;
+
+#if (PG_VERSION_NUM >= 130000)
+	sample->values[METRIC_WAL_BYTES] = instr->walusage.wal_bytes;
+#else
+	/* WAL usage is not tracked before 13 */
+	sample->metrics &= ~(1 << METRIC_WAL_BYTES);
+#endif
+
+	/* I/O timing (only with track_io_timing, zero otherwise) */
+#if (PG_VERSION_NUM >= 170000)
+	io_time = instr->bufusage.shared_blk_read_time;
+	INSTR_TIME_ADD(io_time, instr->bufusage.shared_blk_write_time);
+	INSTR_TIME_ADD(io_time, instr->bufusage.local_blk_read_time);
+	INSTR_TIME_ADD(io_time, instr->bufusage.local_blk_write_time);
+#else
+	io_time = instr->bufusage.blk_read_time;
+	INSTR_TIME_ADD(io_time, instr->bufusage.blk_write_time);
+#endif
+#if (PG_VERSION_NUM >= 150000)
+	INSTR_TIME_ADD(io_time, instr->bufusage.temp_blk_read_time);
+	INSTR_TIME_ADD(io_time, instr->bufusage.temp_blk_write_time);
+#endif
+
+	sample->values[METRIC_IO_TIME] = INSTR_TIME_GET_MILLISEC(io_time);
+
+	/*
+	 * Memory allocated in the per-query context (including children, i.e.
+	 * the hash tables, sorts etc.) - it's not exactly the peak, as some of
+	 * the nodes may have already released their memory, but the contexts
+	 * keep most of the blocks until ExecutorEnd.
+	 */
+#if (PG_VERSION_NUM >= 130000)
+	if (histogram_metrics & (1 << METRIC_MEMORY))
+		sample->values[METRIC_MEMORY] = MemoryContextMemAllocated(queryDesc->estate->es_query_cxt, true) / 1024.0;
+#else
+	sample->metrics &= ~(1 << METRIC_MEMORY);
+#endif
+
+	/* time spent in JIT compilation (only queries that actually were compiled) */
+#if (PG_VERSION_NUM >= 110000)
+	if (queryDesc->estate->es_jit)
+	{
+		JitInstrumentation *jit = &(queryDesc->estate->es_jit->instr);
+		instr_time			jit_time;
+
+		jit_time = jit->generation_counter;
+		INSTR_TIME_ADD(jit_time, jit->inlining_counter);
+		INSTR_TIME_ADD(jit_time, jit->optimization_counter);
+		INSTR_TIME_ADD(jit_time, jit->emission_counter);
+#if (PG_VERSION_NUM >= 170000)
+		INSTR_TIME_ADD(jit_time, jit->deform_counter);
+#endif
+
+		sample->values[METRIC_JIT_TIME] = INSTR_TIME_GET_MILLISEC(jit_time);
+	}
+	else
+		sample->metrics &= ~(1 << METRIC_JIT_TIME);
+#else
+	sample->metrics &= ~(1 << METRIC_JIT_TIME);
+#endif
+
+	/* How well does the cost model fit? (actual time per unit of cost) */
+	if (queryDesc->plannedstmt->planTree->total_cost > 0)
+		sample->values[METRIC_COST_RATIO] = (sample->duration * 1000.0) / queryDesc->plannedstmt->planTree->total_cost;
+	else
+		sample->metrics &= ~(1 << METRIC_COST_RATIO);
+
+	/*
+	 * Q-error of the row estimate of the top node, only for SELECT (for DML
+	 * the processed rows are not the rows produced by the top node). Both
+	 * values are clamped to 1, just like the planner does.
+	 */
+	if (queryDesc->operation == CMD_SELECT)
+	{
+		double	estimate = Max(queryDesc->plannedstmt->planTree->plan_rows, 1.0);
+		double	actual = Max((double) queryDesc->estate->es_processed, 1.0);
+
+		sample->values[METRIC_ROWS_QERROR] = Max(estimate / actual, actual / estimate);
+	}
+	else
+		sample->metrics &= ~(1 << METRIC_ROWS_QERROR);
+}
+
+/*
+ * ProcessUtility hook (see PROCESS_UTILITY_ARGS for the API changes)
+ */
+static void
+#if (PG_VERSION_NUM >= 140000)
+queryhist_ProcessUtility(PlannedStmt *pstmt, const char *queryString,
+						 bool readOnlyTree, ProcessUtilityContext context,
+						 ParamListInfo params, QueryEnvironment *queryEnv,
+						 DestReceiver *dest, QueryCompletion *qc)
+#elif (PG_VERSION_NUM >= 130000)
+queryhist_ProcessUtility(PlannedStmt *pstmt, const char *queryString,
+						 ProcessUtilityContext context, ParamListInfo params,
+						 QueryEnvironment *queryEnv, DestReceiver *dest,
+						 QueryCompletion *qc)
+#elif (PG_VERSION_NUM >= 100000)
+queryhist_ProcessUtility(PlannedStmt *pstmt, const char *queryString,
+						 ProcessUtilityContext context, ParamListInfo params,
+						 QueryEnvironment *queryEnv, DestReceiver *dest,
+						 char *completionTag)
+#else
+queryhist_ProcessUtility(Node *parsetree, const char *queryString,
+						 ProcessUtilityContext context, ParamListInfo params,
+						 DestReceiver *dest, char *completionTag)
+#endif
+{
+	bool	top_level = (nesting_level == 0);
+
+	if (top_level)
+		histogram_statement_start();
+
+	if (default_histogram_utility && (nesting_level == 0) && query_histogram_enabled())
+	{
+		/* collecting histogram is enabled, we're in top level (nesting_level=0) */
+		int		   timing_method = query_histogram_timing_method;
+		double	   start;
+		float	   seconds;
+		bool	   sampled;
+		hook_timer_t timer;
+
+		start = query_hist_clock_read(timing_method);
 
 		nesting_level++;
 		PG_TRY();
 		{
 			if (prev_ProcessUtility)
-#if (PG_VERSION_NUM >= 90300)
-				prev_ProcessUtility(parsetree, queryString, context, params,
-									dest, completionTag);
-#else
-				prev_ProcessUtility(parsetree, queryString, params,
-									isTopLevel, dest, completionTag);
-#endif
+				prev_ProcessUtility(PROCESS_UTILITY_ARGS);
 			else
-#if (PG_VERSION_NUM >= 90300)
-				standard_ProcessUtility(parsetree, queryString, context, params,
-										dest, completionTag);
-#else
-				standard_ProcessUtility(parsetree, queryString, params,
-										isTopLevel, dest, completionTag);
-#endif
+				standard_ProcessUtility(PROCESS_UTILITY_ARGS);
 
 			nesting_level--;
 		}
@@ -442,66 +1609,130 @@ queryhist_ProcessUtility(Node *parsetree, const char *queryString,
 		}
 		PG_END_TRY();
 
-		INSTR_TIME_SET_CURRENT(duration);
-		INSTR_TIME_SUBTRACT(duration, start);
+		seconds = query_hist_clock_elapsed(timing_method, start);
 
-		seconds = INSTR_TIME_GET_DOUBLE(duration);
+		query_hist_timer_start(&timer);
 
-		/* is the histogram static or dynamic? */
-		if (! default_histogram_dynamic) {
+		/* utility statements don't have a queryId */
+		if (query_histogram_slowest_count > 0)
+			query_hist_slowest_add(0, (queryString) ? queryString : "", seconds);
 
-			/* in case of static histogram, it's quite simple - check the number
-			 * of bins and a sample rate - then lock the segment, add the query
-			 * and unlock it again */
-			if ((default_histogram_bins > 0) && (rand() % 100 <  default_histogram_sample_pct)) {
-				LWLockAcquire(shared_histogram_info->lock, LW_EXCLUSIVE);
-				query_hist_add_query(seconds);
-				LWLockRelease(shared_histogram_info->lock);
-			}
+		sampled = query_hist_sample();
+		query_hist_internal_statement(sampled);
 
-		} else {
-			/* when the histogram is dynamic, we have to lock it first, as we
-			 * will access the sample_pct in the histogram */
-			LWLockAcquire(shared_histogram_info->lock, LW_SHARED);
-			if ((shared_histogram_info->bins > 0) && (rand() % 100 <  shared_histogram_info->sample_pct)) {
-				LWLockRelease(shared_histogram_info->lock);
-				LWLockAcquire(shared_histogram_info->lock, LW_EXCLUSIVE);
-				query_hist_add_query(seconds);
-			}
-			LWLockRelease(shared_histogram_info->lock);
+		if (sampled) {
 
+			histogram_sample_t sample;
+
+			/* no metrics for utility commands, just the duration */
+			sample.duration = seconds;
+			sample.rows = -1;
+			sample.concurrency = -1;
+			sample.queryid = 0;
+			sample.query = queryString;
+			sample.metrics = 0;
+			sample.nnodes = 0;
+
+			query_hist_add_sample(&sample);
 		}
 
+		query_hist_timer_stop(&timer);
 	}
 	else
 	{
 		/* collecting histogram is not enabled, so just call the hooks directly */
 		if (prev_ProcessUtility)
-#if (PG_VERSION_NUM >= 90300)
-			prev_ProcessUtility(parsetree, queryString, context, params,
-								dest, completionTag);
-#else
-			prev_ProcessUtility(parsetree, queryString, params,
-								isTopLevel, dest, completionTag);
+			prev_ProcessUtility(PROCESS_UTILITY_ARGS);
+		else
+			standard_ProcessUtility(PROCESS_UTILITY_ARGS);
+	}
+
+	if (top_level)
+		histogram_statement_end();
+}
+
+
+/*
+ * Request additional shared resources.  (These are no-ops if we're not in
+ * the postmaster process.)  We'll allocate or attach to the shared
+ * resources in histogram_shmem_startup().  Since 15 this has to be done
+ * from the shmem_request_hook.
+ */
+static void
+histogram_shmem_request(void)
+{
+#if (PG_VERSION_NUM >= 150000)
+	if (prev_shmem_request_hook)
+		prev_shmem_request_hook();
 #endif
-			else
-#if (PG_VERSION_NUM >= 90300)
-			standard_ProcessUtility(parsetree, queryString, context, params,
-									dest, completionTag);
-#else
-			standard_ProcessUtility(parsetree, queryString, params,
-									isTopLevel, dest, completionTag);
+
+	/* since 18 the histogram itself is allocated by pgstat */
+#if (PG_VERSION_NUM < 180000)
+	RequestAddinShmemSpace(get_histogram_size());
+	RequestNamedLWLockTranche("query_histogram", 1);
 #endif
+
+	RequestAddinShmemSpace(MAXALIGN(sizeof(pg_atomic_uint32)));
+	RequestAddinShmemSpace(query_hist_internal_shmem_size());
+	RequestAddinShmemSpace(MAXALIGN(sizeof(histogram_exemplar_t) * (HIST_BINS_MAX+1)));
+
+	if (query_histogram_max_plans > 0) {
+		RequestAddinShmemSpace(query_hist_plans_shmem_size());
+		RequestNamedLWLockTranche("query_histogram_plans", 1);
+	}
+
+	if (query_histogram_slowest_count > 0) {
+		RequestAddinShmemSpace(query_hist_slowest_shmem_size());
+		RequestNamedLWLockTranche("query_histogram_slowest", 1);
+	}
+
+	if (query_histogram_plan_capture_size > 0) {
+		RequestAddinShmemSpace(query_hist_capture_shmem_size());
+		RequestNamedLWLockTranche("query_histogram_capture", 1);
 	}
+
+	if (query_histogram_wait_sample_rate > 0) {
+		RequestAddinShmemSpace(query_hist_waits_shmem_size());
+		RequestNamedLWLockTranche("query_histogram_waits", 1);
+	}
+}
+
+#if (PG_VERSION_NUM >= 180000)
+
+/* The shared memory is allocated (and initialized) by pgstat, so all we
+ * need to do is to remember where the histogram is. */
+static void
+histogram_shmem_startup()
+{
+	histogram_shared_t * shared;
+
+	if (prev_shmem_startup_hook)
+		prev_shmem_startup_hook();
+
+	shared = (histogram_shared_t *) pgstat_get_custom_shmem_data(PGSTAT_KIND_QUERY_HISTOGRAM);
+	shared_histogram_info = &(shared->info);
+
+	/* the tranche name is backend-local (matters with EXEC_BACKEND) */
+	LWLockRegisterTranche(shared->tranche_id, "query_histogram");
+
+	histogram_active_shmem_startup();
+	query_hist_internal_shmem_startup();
+	query_hist_plans_shmem_startup();
+	query_hist_slowest_shmem_startup();
+	query_hist_capture_shmem_startup();
+	query_hist_waits_shmem_startup();
+
+	histogram_is_dynamic = default_histogram_dynamic;
 }
 
+#else
 
 /* This is probably the most important part - allocates the shared
  * segment, initializes it etc. */
 static void
 histogram_shmem_startup()
 {
-	bool found = FALSE;
+	bool found = false;
 
 	if (prev_shmem_startup_hook)
 		prev_shmem_startup_hook();
@@ -530,6 +1761,10 @@ histogram_shmem_startup()
 
 		memset(shared_histogram_info->count_bins, 0, (HIST_BINS_MAX+1)*sizeof(count_bin_t));
 		memset(shared_histogram_info->time_bins,  0, (HIST_BINS_MAX+1)*sizeof(time_bin_t));
+		memset(shared_histogram_info->metrics,    0, METRIC_COUNT*sizeof(metric_histogram_t));
+		memset(shared_histogram_info->heatmap,    0, sizeof(shared_histogram_info->heatmap));
+		memset(shared_histogram_info->concurrency, 0, sizeof(shared_histogram_info->concurrency));
+		memset(shared_histogram_info->nodes,      0, sizeof(shared_histogram_info->nodes));
 
 		elog(DEBUG1, "shared memory segment (query histogram) successfully created");
 
@@ -537,6 +1772,13 @@ histogram_shmem_startup()
 
 	LWLockRelease(AddinShmemInitLock);
 
+	histogram_active_shmem_startup();
+	query_hist_internal_shmem_startup();
+	query_hist_plans_shmem_startup();
+	query_hist_slowest_shmem_startup();
+	query_hist_capture_shmem_startup();
+	query_hist_waits_shmem_startup();
+
 	/*
 	 * If we're in the postmaster (or a standalone backend...), set up a shmem
 	 * exit hook to dump the statistics to disk.
@@ -553,10 +1795,58 @@ histogram_shmem_startup()
 	// srand((int)shared_histogram_info);
 }
 
-/* Loads the histogram data from a file (and checks that the md5 hash of the contents matches). */
-static void histogram_load_from_file(void)
+#endif
+
+/* Attaches to the counter of active backends and to the exemplars (or
+ * creates them). */
+static void
+histogram_active_shmem_startup(void)
 {
-	FILE * file;
+	bool found;
+
+	LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+
+	shared_active_backends = ShmemInitStruct("query_histogram_active",
+											 sizeof(pg_atomic_uint32),
+											 &found);
+
+	if (! found)
+		pg_atomic_init_u32(shared_active_backends, 0);
+
+	shared_exemplars = ShmemInitStruct("query_histogram_exemplars",
+									   sizeof(histogram_exemplar_t) * (HIST_BINS_MAX+1),
+									   &found);
+
+	if (! found)
+		memset(shared_exemplars, 0, sizeof(histogram_exemplar_t) * (HIST_BINS_MAX+1));
+
+	LWLockRelease(AddinShmemInitLock);
+}
+
+#if (PG_VERSION_NUM < 180000)
+
+/* MD5 of the histogram (pg_md5_binary reports the error since 15) */
+static bool
+histogram_md5(const void *data, size_t len, char *hash)
+{
+#if (PG_VERSION_NUM >= 150000)
+	const char *errstr = NULL;
+
+	if (! pg_md5_binary(data, len, hash, &errstr)) {
+		elog(LOG, "could not compute MD5 of the query histogram: %s", errstr);
+		return false;
+	}
+
+	return true;
+#else
+	return pg_md5_binary(data, len, hash);
+#endif
+}
+
+/* Loads the histogram data from a file (and checks that the md5 hash of the contents matches). */
+static void histogram_load_from_file(void)
+{
+	FILE * file;
 	char hash_file[16];
 	char hash_comp[16];
 	char * buffer = NULL;
@@ -581,7 +1871,8 @@ static void histogram_load_from_file(void)
 		goto error;
 
 	/* compute md5 hash of the buffer */
-	pg_md5_binary(buffer, sizeof(histogram_info_t), hash_comp);
+	if (! histogram_md5(buffer, sizeof(histogram_info_t), hash_comp))
+		goto error;
 
 	/* check that the hashes are equal (the file is not corrupted) */
 	if (memcmp(hash_file, hash_comp, 16) == 0) {
@@ -641,88 +1932,618 @@ error: /* error handling */
 
 /* Dumps the histogram data into a file (with a md5 hash of the contents at the beginning). */
 static void
-histogram_shmem_shutdown(int code, Datum arg)
+histogram_shmem_shutdown(int code, Datum arg)
+{
+	FILE * file;
+	char buffer[16];
+
+	file = AllocateFile(HISTOGRAM_DUMP_FILE, PG_BINARY_W);
+	if (file == NULL)
+		goto error;
+
+	/* lets compute MD5 hash of the shared memory segment and write it to
+	 * the beginning of the file */
+	if (! histogram_md5(shared_histogram_info, sizeof(histogram_info_t), buffer))
+		goto error;
+
+	if (fwrite(buffer, 16, 1, file) != 1)
+		goto error;
+
+	/* now write the actual shared segment */
+	if (fwrite(shared_histogram_info, sizeof(histogram_info_t), 1, file) != 1)
+		goto error;
+
+	FreeFile(file);
+
+	return;
+
+error:
+	ereport(LOG,
+			(errcode_for_file_access(),
+			 errmsg("could not write query histogram file \"%s\": %m",
+					HISTOGRAM_DUMP_FILE)));
+	if (file)
+		FreeFile(file);
+}
+
+#else
+
+/* pgstat callback, initializes the shared histogram (only in postmaster) */
+static void
+histogram_stats_init_shmem(void *stats)
+{
+	histogram_shared_t * shared = (histogram_shared_t *) stats;
+
+	/* a separate tranche, so that the waits for the lock are not lumped
+	 * together with the waits for the other stats (PgStatsData) */
+	shared->tranche_id = LWLockNewTrancheId();
+	LWLockRegisterTranche(shared->tranche_id, "query_histogram");
+
+	LWLockInitialize(&(shared->lock), shared->tranche_id);
+
+	shared->info.lock = &(shared->lock);
+
+	shared->info.type = default_histogram_type;
+	shared->info.bins = default_histogram_bins;
+	shared->info.step = default_histogram_step;
+	shared->info.sample_pct = default_histogram_sample_pct;
+	shared->info.track_utility = default_histogram_utility;
+	shared->info.last_reset = GetCurrentTimestamp();
+
+	memset(shared->info.count_bins, 0, (HIST_BINS_MAX+1)*sizeof(count_bin_t));
+	memset(shared->info.time_bins,  0, (HIST_BINS_MAX+1)*sizeof(time_bin_t));
+	memset(shared->info.metrics,    0, METRIC_COUNT*sizeof(metric_histogram_t));
+	memset(shared->info.heatmap,    0, sizeof(shared->info.heatmap));
+	memset(shared->info.concurrency, 0, sizeof(shared->info.concurrency));
+	memset(shared->info.nodes,      0, sizeof(shared->info.nodes));
+}
+
+/* pgstat callback, merges the pending (backend-local) histogram into the
+ * shared one - returns true if the data could not be flushed because of
+ * a lock conflict (only with nowait=true) */
+static bool
+histogram_stats_flush(bool nowait)
+{
+	int i, j, m;
+
+	if (! pending_histogram.has_data)
+		return false;
+
+	if (! nowait)
+		query_hist_lock_acquire(shared_histogram_info->lock, LW_EXCLUSIVE);
+	else if (! LWLockConditionalAcquire(shared_histogram_info->lock, LW_EXCLUSIVE))
+		return true;
+	else
+		query_hist_lock_acquired();
+
+	/* The histogram restored from disk may have been built with different
+	 * parameters than the static ones from the config file - in that case
+	 * we need to start from scratch (just like when loading the file). */
+	if ((! default_histogram_dynamic) &&
+		((shared_histogram_info->bins != default_histogram_bins) ||
+		 (shared_histogram_info->step != default_histogram_step) ||
+		 (shared_histogram_info->sample_pct != default_histogram_sample_pct) ||
+		 (shared_histogram_info->type != default_histogram_type))) {
+
+		elog(WARNING, "discarding the restored query histogram because the parameters differ");
+
+		shared_histogram_info->type = default_histogram_type;
+		shared_histogram_info->bins = default_histogram_bins;
+		shared_histogram_info->step = default_histogram_step;
+		shared_histogram_info->sample_pct = default_histogram_sample_pct;
+
+		query_hist_reset(true);
+	}
+
+	/* If the histogram was modified since the pending data were collected,
+	 * the bins do not match and we have to throw the data away. */
+	if ((shared_histogram_info->type == pending_histogram.type) &&
+		(shared_histogram_info->bins == pending_histogram.bins) &&
+		(shared_histogram_info->step == pending_histogram.step)) {
+
+		for (i = 0; i < (pending_histogram.bins+1); i++) {
+			shared_histogram_info->count_bins[i] += pending_histogram.count_bins[i];
+			shared_histogram_info->time_bins[i]  += pending_histogram.time_bins[i];
+		}
+	}
+
+	for (m = 0; m < METRIC_COUNT; m++) {
+
+		metric_histogram_t * dst = &(shared_histogram_info->metrics[m]);
+		metric_histogram_t * src = &(pending_histogram.metrics[m]);
+
+		for (i = 0; i < (METRIC_BINS_MAX+1); i++) {
+			dst->count_bins[i] += src->count_bins[i];
+			dst->value_bins[i] += src->value_bins[i];
+			dst->time_bins[i]  += src->time_bins[i];
+		}
+	}
+
+	for (i = 0; i < HEATMAP_BINS; i++) {
+		for (j = 0; j < HEATMAP_BINS; j++) {
+			shared_histogram_info->heatmap[i][j] += pending_histogram.heatmap[i][j];
+		}
+
+		for (j = 0; j < CONCURRENCY_BINS; j++) {
+			shared_histogram_info->concurrency[i][j] += pending_histogram.concurrency[i][j];
+		}
+	}
+
+	query_hist_merge_node_times(shared_histogram_info->nodes, pending_histogram.nodes);
+
+	LWLockRelease(shared_histogram_info->lock);
+
+	memset(&pending_histogram, 0, sizeof(histogram_pending_t));
+
+	return false;
+}
+
+/* pgstat callback, called by pgstat_reset_of_kind() */
+static void
+histogram_stats_reset_all(TimestampTz ts)
+{
+	LWLockAcquire(shared_histogram_info->lock, LW_EXCLUSIVE);
+
+	query_hist_reset(true);
+	shared_histogram_info->last_reset = ts;
+
+	LWLockRelease(shared_histogram_info->lock);
+}
+
+/* pgstat callback, copies the shared histogram into the snapshot (we don't
+ * really use the snapshot ourselves, query_hist_get_data reads the shared
+ * histogram directly) */
+static void
+histogram_stats_snapshot(void)
+{
+	void * snapshot = pgstat_get_custom_snapshot_data(PGSTAT_KIND_QUERY_HISTOGRAM);
+
+	LWLockAcquire(shared_histogram_info->lock, LW_SHARED);
+	memcpy(snapshot, &(shared_histogram_info->last_reset),
+		   sizeof(histogram_shared_t) - HISTOGRAM_SHARED_DATA_OFF);
+	LWLockRelease(shared_histogram_info->lock);
+}
+
+#endif
+
+/* need an exclusive lock to modify the histogram */
+void
+query_hist_reset(bool locked)
+{
+	if (! shared_histogram_info) {
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("query_histogram must be loaded via shared_preload_libraries")));
+	}
+
+#if (PG_VERSION_NUM >= 180000)
+	/* let pgstat do the reset (it calls histogram_stats_reset_all), but
+	 * don't flush our own pending data into the new histogram */
+	if (! locked) {
+		memset(&pending_histogram, 0, sizeof(histogram_pending_t));
+		pgstat_reset_of_kind(PGSTAT_KIND_QUERY_HISTOGRAM);
+		return;
+	}
+#else
+	/* don't merge our own pending events into the new histogram */
+	memset(pending_events, 0, sizeof(pending_events));
+	pending_events_count = 0;
+#endif
+
+	if (! locked) {
+		LWLockAcquire(shared_histogram_info->lock, LW_EXCLUSIVE);
+	}
+
+	memset(shared_histogram_info->count_bins, 0, (HIST_BINS_MAX+1)*sizeof(count_bin_t));
+	memset(shared_histogram_info->time_bins,  0, (HIST_BINS_MAX+1)*sizeof(time_bin_t));
+	memset(shared_histogram_info->metrics,    0, METRIC_COUNT*sizeof(metric_histogram_t));
+	memset(shared_histogram_info->heatmap,    0, sizeof(shared_histogram_info->heatmap));
+	memset(shared_histogram_info->concurrency, 0, sizeof(shared_histogram_info->concurrency));
+	memset(shared_histogram_info->nodes,      0, sizeof(shared_histogram_info->nodes));
+
+	/* the bins may have changed, so the exemplars may be in wrong bins */
+	if (shared_exemplars)
+		memset(shared_exemplars, 0, sizeof(histogram_exemplar_t) * (HIST_BINS_MAX+1));
+
+	shared_histogram_info->last_reset = GetCurrentTimestamp();
+
+	/* if it was not locked before, we can release the lock now */
+	if (! locked) {
+		LWLockRelease(shared_histogram_info->lock);
+	}
+}
+
+/*
+ * Decides whether the query should be sampled, which depends on the number
+ * of bins and the sampling rate.
+ */
+static bool
+query_hist_sample(void)
+{
+	bool sample = false;
+
+#if (PG_VERSION_NUM >= 180000)
+
+	/* The queries are collected in a backend-local histogram, so there's
+	 * no need to lock anything even for dynamic histograms - if someone
+	 * changes the parameters concurrently, we'll just sample a few more
+	 * queries with the old values (the flush discards them anyway). */
+	int bins = (default_histogram_dynamic) ? shared_histogram_info->bins : default_histogram_bins;
+	int sample_pct = (default_histogram_dynamic) ? shared_histogram_info->sample_pct : default_histogram_sample_pct;
+
+	sample = ((bins > 0) && (rand() % 100 < sample_pct));
+
+#else
+
+	/* is the histogram static or dynamic? */
+	if (! default_histogram_dynamic) {
+
+		/* in case of static histogram, it's quite simple - check the number
+		 * of bins and a sample rate */
+		sample = ((default_histogram_bins > 0) && (rand() % 100 <  default_histogram_sample_pct));
+
+	} else {
+		/* when the histogram is dynamic, we have to lock it first, as we
+		 * will access the sample_pct in the histogram */
+		query_hist_lock_acquire(shared_histogram_info->lock, LW_SHARED);
+		sample = ((shared_histogram_info->bins > 0) && (rand() % 100 <  shared_histogram_info->sample_pct));
+		LWLockRelease(shared_histogram_info->lock);
+
+	}
+
+#endif
+
+	return sample;
+}
+
+/*
+ * Adds a sampled query (duration and the enabled metrics) to the histogram,
+ * the locking (if any) is handled here. Returns the bin of the query.
+ */
+static int
+query_hist_add_sample(histogram_sample_t * sample)
+{
+	int metric;
+	int bin;
+
+#if (PG_VERSION_NUM < 180000)
+	query_hist_lock_acquire(shared_histogram_info->lock, LW_EXCLUSIVE);
+#endif
+
+	bin = query_hist_add_query(sample->duration);
+
+	for (metric = 0; metric < METRIC_COUNT; metric++) {
+		if (sample->metrics & (1 << metric)) {
+#if (PG_VERSION_NUM >= 180000)
+			query_hist_add_metric(&(pending_histogram.metrics[metric]), metric,
+								  sample->values[metric], sample->duration);
+			pending_histogram.has_data = true;
+#else
+			query_hist_add_metric(&(shared_histogram_info->metrics[metric]), metric,
+								  sample->values[metric], sample->duration);
+#endif
+		}
+	}
+
+	if (sample->rows >= 0) {
+
+		int time_bin = get_log2_bin((uint64) (sample->duration * 1000000.0), HEATMAP_BINS);
+		int rows_bin = get_log2_bin((uint64) sample->rows, HEATMAP_BINS);
+
+#if (PG_VERSION_NUM >= 180000)
+		pending_histogram.heatmap[time_bin][rows_bin] += 1;
+		pending_histogram.has_data = true;
+#else
+		shared_histogram_info->heatmap[time_bin][rows_bin] += 1;
+#endif
+	}
+
+	if (sample->concurrency >= 0) {
+
+		int time_bin = get_log2_bin((uint64) (sample->duration * 1000000.0), HEATMAP_BINS);
+		int concurrency_bin = get_log2_bin((uint64) sample->concurrency, CONCURRENCY_BINS);
+
+#if (PG_VERSION_NUM >= 180000)
+		pending_histogram.concurrency[time_bin][concurrency_bin] += 1;
+		pending_histogram.has_data = true;
+#else
+		shared_histogram_info->concurrency[time_bin][concurrency_bin] += 1;
+#endif
+	}
+
+	if (sample->nnodes > 0) {
+#if (PG_VERSION_NUM >= 180000)
+		query_hist_add_node_times(pending_histogram.nodes, sample);
+		pending_histogram.has_data = true;
+#else
+		query_hist_add_node_times(shared_histogram_info->nodes, sample);
+#endif
+	}
+
+#if (PG_VERSION_NUM < 180000)
+	LWLockRelease(shared_histogram_info->lock);
+#endif
+
+	query_hist_set_exemplar(bin, sample);
+
+	return bin;
+}
+
+/* Is the bin one of the last plan_capture_bins bins (or the overflow one)? */
+static bool
+query_hist_is_tail_bin(int bin)
+{
+	int bins = (default_histogram_dynamic) ? shared_histogram_info->bins : default_histogram_bins;
+
+	return (bin >= bins - default_histogram_plan_capture_bins);
+}
+
+/*
+ * Makes the statement the exemplar of the bin. This is done without any
+ * locking (plain stores), so concurrent readers or writers may see a mix
+ * of two statements - that's fine for an exemplar.
+ */
+static void
+query_hist_set_exemplar(int bin, histogram_sample_t * sample)
+{
+	volatile histogram_exemplar_t *exemplar = &shared_exemplars[bin];
+
+	exemplar->queryid = sample->queryid;
+	exemplar->pid = MyProcPid;
+	exemplar->timestamp = GetCurrentTimestamp();
+
+	if (default_histogram_exemplar_text && sample->query)
+	{
+		/* don't cut the query in the middle of a multi-byte character */
+		int len = pg_mbcliplen(sample->query, strnlen(sample->query, EXEMPLAR_QUERY_LEN),
+							   EXEMPLAR_QUERY_LEN - 1);
+
+		memcpy((char *) exemplar->query, sample->query, len);
+		exemplar->query[len] = '\0';
+	}
+	else
+		exemplar->query[0] = '\0';
+}
+
+#if (PG_VERSION_NUM >= 180000)
+
+/* adds the query to the pending (backend-local) histogram, no lock needed,
+ * returns the bin the query was added to */
+static int
+query_hist_add_query(time_bin_t duration)
+{
+	int bin;
+	int type = (default_histogram_dynamic) ? shared_histogram_info->type : default_histogram_type;
+	int bins = (default_histogram_dynamic) ? shared_histogram_info->bins : default_histogram_bins;
+	int step = (default_histogram_dynamic) ? shared_histogram_info->step : default_histogram_step;
+
+	/* the histogram was modified, so the pending data are useless (the
+	 * metric histograms don't depend on the parameters, keep those) */
+	if ((pending_histogram.type != type) || (pending_histogram.bins != bins) ||
+		(pending_histogram.step != step)) {
+
+		memset(pending_histogram.count_bins, 0, (HIST_BINS_MAX+1)*sizeof(count_bin_t));
+		memset(pending_histogram.time_bins,  0, (HIST_BINS_MAX+1)*sizeof(time_bin_t));
+
+		pending_histogram.type = type;
+		pending_histogram.bins = bins;
+		pending_histogram.step = step;
+	}
+
+	bin = get_hist_bin(type, bins, step, duration);
+
+	pending_histogram.count_bins[bin] += 1;
+	pending_histogram.time_bins[bin] += duration;
+	pending_histogram.has_data = true;
+
+	/* make sure pgstat_report_stat() calls histogram_stats_flush() */
+	pgstat_report_fixed = true;
+
+	return bin;
+}
+
+#else
+
+/* needs to be already locked, returns the bin the query was added to */
+static int
+query_hist_add_query(time_bin_t duration)
+{
+	int bin = get_hist_bin(shared_histogram_info->type, shared_histogram_info->bins,
+						   shared_histogram_info->step, duration);
+
+	shared_histogram_info->count_bins[bin] += 1;
+	shared_histogram_info->time_bins[bin] += duration;
+
+	return bin;
+}
+
+#endif
+
+/*
+ * Adds an event that is not a sampled query (e.g. a commit) into the metric
+ * histogram - the value is the duration of the event (in miliseconds).
+ */
+static void
+query_hist_add_event(int metric, double seconds)
+{
+#if (PG_VERSION_NUM >= 180000)
+	query_hist_add_metric(&(pending_histogram.metrics[metric]), metric,
+						  seconds * 1000.0, seconds);
+	pending_histogram.has_data = true;
+
+	/* make sure pgstat_report_stat() calls histogram_stats_flush() */
+	pgstat_report_fixed = true;
+#else
+	instr_time	now;
+
+	/* flush the pending events when the backend exits */
+	if (! pending_events_registered) {
+		before_shmem_exit(histogram_events_exit, (Datum) 0);
+		pending_events_registered = true;
+	}
+
+	INSTR_TIME_SET_CURRENT(now);
+
+	if (pending_events_count++ == 0)
+		pending_events_start = now;
+
+	query_hist_add_metric(&(pending_events[metric]), metric,
+						  seconds * 1000.0, seconds);
+
+	INSTR_TIME_SUBTRACT(now, pending_events_start);
+
+	if ((pending_events_count >= EVENTS_FLUSH_COUNT) ||
+		(INSTR_TIME_GET_MILLISEC(now) >= EVENTS_FLUSH_INTERVAL))
+		histogram_events_flush(true);
+#endif
+}
+
+#if (PG_VERSION_NUM < 180000)
+
+/* merges the pending events into the shared histogram (with nowait=true
+ * only if the lock is available right away) */
+static void
+histogram_events_flush(bool nowait)
+{
+	int i, m;
+
+	if ((pending_events_count == 0) || (! shared_histogram_info))
+		return;
+
+	if (! nowait)
+		query_hist_lock_acquire(shared_histogram_info->lock, LW_EXCLUSIVE);
+	else if (! LWLockConditionalAcquire(shared_histogram_info->lock, LW_EXCLUSIVE))
+		return;
+	else
+		query_hist_lock_acquired();
+
+	for (m = 0; m < METRIC_COUNT; m++) {
+
+		metric_histogram_t * dst = &(shared_histogram_info->metrics[m]);
+		metric_histogram_t * src = &(pending_events[m]);
+
+		for (i = 0; i < (METRIC_BINS_MAX+1); i++) {
+			dst->count_bins[i] += src->count_bins[i];
+			dst->value_bins[i] += src->value_bins[i];
+			dst->time_bins[i]  += src->time_bins[i];
+		}
+	}
+
+	LWLockRelease(shared_histogram_info->lock);
+
+	memset(pending_events, 0, sizeof(pending_events));
+	pending_events_count = 0;
+}
+
+/* before_shmem_exit callback, so that the last few events are not lost */
+static void
+histogram_events_exit(int code, Datum arg)
+{
+	histogram_events_flush(false);
+}
+
+#endif
+
+/* adds a value of the metric to the histogram (shared or pending) */
+static void
+query_hist_add_metric(metric_histogram_t * hist, int metric, double value, time_bin_t duration)
 {
-	FILE * file;
-	char buffer[16];
+	int bin = get_metric_bin(metric_info[metric].unit, value);
 
-	file = AllocateFile(HISTOGRAM_DUMP_FILE, PG_BINARY_W);
-	if (file == NULL)
-		goto error;
+	hist->count_bins[bin] += 1;
+	hist->value_bins[bin] += value;
+	hist->time_bins[bin]  += duration;
+}
 
-	/* lets compute MD5 hash of the shared memory segment and write it to
-	 * the beginning of the file */
-	pg_md5_binary(shared_histogram_info, sizeof(histogram_info_t), buffer);
+static int
+get_hist_bin(int type, int bins, int step, time_bin_t duration)
+{
+	int bin = 0;
 
-	if (fwrite(buffer, 16, 1, file) != 1)
-		goto error;
+	/* a negative value would give bin -1 (linear) or NaN (log) */
+	if (duration < 0)
+		duration = 0;
 
-	/* now write the actual shared segment */
-	if (fwrite(shared_histogram_info, sizeof(histogram_info_t), 1, file) != 1)
-		goto error;
+	if (type == HISTOGRAM_LINEAR) {
+		bin = (int)floor((duration * 1000.0) / step);
+	} else {
+		bin = (int)floor(log2(1 + ((duration * 1000.0) / step)));
+	}
 
-	FreeFile(file);
+	/* queries that take longer than the last bin should go to
+	 * the (HIST_BINS_MAX+1) bin */
+	return (bin >= bins) ? bins : bin;
+}
 
-	return;
+/*
+ * Boundaries (in ms) of a bin of the histogram, consistent with get_hist_bin.
+ * Linear bin i is [i * step, (i+1) * step), logarithmic bin i is
+ * [(2^i - 1) * step, (2^(i+1) - 1) * step), i.e. [0, step), [step, 3*step),
+ * [3*step, 7*step) and so on. The overflow bin has no upper boundary, the
+ * callers need to handle that.
+ */
+double
+query_hist_bin_lower(int type, int step, int bin)
+{
+	if (type == HISTOGRAM_LINEAR)
+		return (double) bin * step;
 
-error:
-	ereport(LOG,
-			(errcode_for_file_access(),
-			 errmsg("could not write query histogram file \"%s\": %m",
-					HISTOGRAM_DUMP_FILE)));
-	if (file)
-		FreeFile(file);
+	return (ldexp(1.0, bin) - 1) * step;
 }
 
-/* need an exclusive lock to modify the histogram */
-void
-query_hist_reset(bool locked)
+double
+query_hist_bin_upper(int type, int step, int bin)
 {
-	if (! shared_histogram_info) {
-		ereport(ERROR,
-				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
-				 errmsg("query_histogram must be loaded via shared_preload_libraries")));
-	}
+	return query_hist_bin_lower(type, step, bin + 1);
+}
 
-	if (! locked) {
-		LWLockAcquire(shared_histogram_info->lock, LW_EXCLUSIVE);
-	}
+/* bin 0 is for values below the unit, bin i for [unit * 2^(i-1), unit * 2^i)
+ * and the last one for values that don't fit into the regular bins */
+static int
+get_metric_bin(double unit, double value)
+{
+	int exponent;
 
-	memset(shared_histogram_info->count_bins, 0, (HIST_BINS_MAX+1)*sizeof(count_bin_t));
-	memset(shared_histogram_info->time_bins,  0, (HIST_BINS_MAX+1)*sizeof(time_bin_t));
+	if (value < unit)
+		return 0;
 
-	shared_histogram_info->last_reset = GetCurrentTimestamp();
+	/* value/unit = m * 2^exponent with m in [0.5, 1) */
+	frexp(value / unit, &exponent);
 
-	/* if it was not locked before, we can release the lock now */
-	if (! locked) {
-		LWLockRelease(shared_histogram_info->lock);
-	}
+	return (exponent >= METRIC_BINS_MAX) ? METRIC_BINS_MAX : exponent;
 }
 
-/* needs to be already locked */
-static void
-query_hist_add_query(time_bin_t duration)
+/* bin 0 is for zero, bin i for [2^(i-1), 2^i), and the last bin (bins-1)
+ * for all values that don't fit into the regular bins */
+int
+get_log2_bin(uint64 value, int bins)
 {
-	int bin = get_hist_bin(shared_histogram_info->bins, shared_histogram_info->step, duration);
+	int bin;
 
-	shared_histogram_info->count_bins[bin] += 1;
-	shared_histogram_info->time_bins[bin] += duration;
+	if (value == 0)
+		return 0;
+
+#if (PG_VERSION_NUM >= 120000)
+	bin = pg_leftmost_one_pos64(value) + 1;
+#else
+	bin = 64 - __builtin_clzll(value);
+#endif
+
+	return (bin >= bins) ? (bins - 1) : bin;
 }
 
+/* returns index of the metric with the given name (or -1) */
 static int
-get_hist_bin(int bins, int step, time_bin_t duration)
+get_metric_by_name(const char * name)
 {
-	int bin = 0;
+	int metric;
 
-	if (shared_histogram_info->type == HISTOGRAM_LINEAR) {
-		bin = (int)floor((duration * 1000.0) / (shared_histogram_info->step));
-	} else {
-		bin = (int)floor(log2(1 + ((duration * 1000.0) / (shared_histogram_info->step))));
+	for (metric = 0; metric < METRIC_COUNT; metric++) {
+		if (pg_strcasecmp(metric_info[metric].name, name) == 0)
+			return metric;
 	}
 
-	/* queries that take longer than the last bin should go to
-	 * the (HIST_BINS_MAX+1) bin */
-	return (bin >= (shared_histogram_info->bins)) ? (shared_histogram_info->bins) : bin;
+	return -1;
 }
 
 TimestampTz
@@ -743,6 +2564,25 @@ get_hist_last_reset()
 	return timestamp;
 }
 
+/* sampling rate (needed to scale the data stored elsewhere) */
+int
+get_hist_sample_pct()
+{
+	int sample_pct;
+
+	if (! shared_histogram_info) {
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("query_histogram must be loaded via shared_preload_libraries")));
+	}
+
+	LWLockAcquire(shared_histogram_info->lock, LW_SHARED);
+	sample_pct = shared_histogram_info->sample_pct;
+	LWLockRelease(shared_histogram_info->lock);
+
+	return sample_pct;
+}
+
 histogram_data *
 query_hist_get_data(bool scale)
 {
@@ -775,6 +2615,13 @@ query_hist_get_data(bool scale)
 		memcpy(tmp->count_data, shared_histogram_info->count_bins, sizeof(count_bin_t) * (shared_histogram_info->bins+1));
 		memcpy(tmp->time_data,  shared_histogram_info->time_bins,  sizeof(time_bin_t)  * (shared_histogram_info->bins+1));
 
+		/* keep the recorded counts, for the confidence intervals */
+		if (scale) {
+			tmp->sample_pct = shared_histogram_info->sample_pct;
+			tmp->sample_data = (count_bin_t *) palloc(sizeof(count_bin_t) * (shared_histogram_info->bins+1));
+			memcpy(tmp->sample_data, tmp->count_data, sizeof(count_bin_t) * (shared_histogram_info->bins+1));
+		}
+
 		/* check if we need to scale the histogram */
 		if (scale && (shared_histogram_info->sample_pct < 100)) {
 			coeff = (100.0 / (shared_histogram_info->sample_pct));
@@ -789,6 +2636,14 @@ query_hist_get_data(bool scale)
 			tmp->total_time  += tmp->time_data[i];
 		}
 
+		/* the exemplars are not protected by the lock, the copy may be
+		 * inconsistent but that does not matter */
+		tmp->exemplars = (histogram_exemplar_t *) palloc(sizeof(histogram_exemplar_t) * (shared_histogram_info->bins+1));
+		memcpy(tmp->exemplars, shared_exemplars, sizeof(histogram_exemplar_t) * (shared_histogram_info->bins+1));
+
+		for (i = 0; i < (shared_histogram_info->bins+1); i++)
+			tmp->exemplars[i].query[EXEMPLAR_QUERY_LEN-1] = '\0';
+
 	}
 
 	/* release the lock */
@@ -797,6 +2652,276 @@ query_hist_get_data(bool scale)
 	return tmp;
 }
 
+/*
+ * Builds a histogram of queries that are still running, using the current
+ * age of the statements (from st_activity_start_timestamp). The backend
+ * status array is read without locking (pgstat uses the st_changecount
+ * protocol for that), so this does not block the backends in any way. The
+ * result uses the same bins as the regular histogram and is never scaled
+ * (it's not sampled).
+ */
+histogram_data *
+query_hist_get_inflight_data(void)
+{
+	int i;
+	int nbackends;
+	TimestampTz now;
+	histogram_data * tmp = NULL;
+
+	if (! shared_histogram_info) {
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("query_histogram must be loaded via shared_preload_libraries")));
+	}
+
+	tmp = (histogram_data *)palloc0(sizeof(histogram_data));
+
+	/*
+	 * No lock here, the backends recording their queries hold it in exclusive
+	 * mode. In the dynamic mode a concurrent SET may give us a mix of the old
+	 * and new layout, but that only puts some statements into the wrong bin
+	 * of this snapshot (each of the values is valid on its own).
+	 */
+	if (default_histogram_dynamic) {
+		volatile histogram_info_t *info = shared_histogram_info;
+
+		tmp->histogram_type = info->type;
+		tmp->bins_count = info->bins;
+		tmp->bins_width = info->step;
+	} else {
+		tmp->histogram_type = default_histogram_type;
+		tmp->bins_count = default_histogram_bins;
+		tmp->bins_width = default_histogram_step;
+	}
+
+	if (tmp->bins_count == 0)
+		return tmp;
+
+	tmp->count_data = (count_bin_t *) palloc0(sizeof(count_bin_t) * (tmp->bins_count+1));
+	tmp->time_data  =  (time_bin_t *) palloc0(sizeof(time_bin_t)  * (tmp->bins_count+1));
+
+	now = GetCurrentTimestamp();
+	nbackends = pgstat_fetch_stat_numbackends();
+
+	for (i = 1; i <= nbackends; i++) {
+
+		LocalPgBackendStatus *local;
+		PgBackendStatus *beentry;
+		long		secs;
+		int			usecs;
+		double		seconds;
+		int			bin;
+
+#if (PG_VERSION_NUM >= 160000)
+		local = pgstat_get_local_beentry_by_index(i);
+#else
+		local = pgstat_fetch_stat_local_beentry(i);
+#endif
+
+		if (! local)
+			continue;
+
+		beentry = &(local->backendStatus);
+
+		/* only statements running in regular backends (not our own) */
+		if ((beentry->st_state != STATE_RUNNING) || (beentry->st_procpid == MyProcPid))
+			continue;
+
+#if (PG_VERSION_NUM >= 100000)
+		if (beentry->st_backendType != B_BACKEND)
+			continue;
+#endif
+
+		TimestampDifference(beentry->st_activity_start_timestamp, now, &secs, &usecs);
+		seconds = secs + usecs / 1000000.0;
+
+		bin = get_hist_bin(tmp->histogram_type, tmp->bins_count, tmp->bins_width, seconds);
+
+		tmp->count_data[bin] += 1;
+		tmp->time_data[bin]  += seconds;
+
+		tmp->total_count += 1;
+		tmp->total_time  += seconds;
+	}
+
+	return tmp;
+}
+
+metric_data *
+query_hist_get_metric_data(const char * name, bool scale)
+{
+	int i = 0;
+	int metric;
+	double coeff = 0;
+	metric_data * tmp = NULL;
+	metric_histogram_t * hist;
+
+	if (! shared_histogram_info) {
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("query_histogram must be loaded via shared_preload_libraries")));
+	}
+
+	metric = get_metric_by_name(name);
+
+	if (metric < 0) {
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("unknown metric \"%s\"", name)));
+	}
+
+	hist = &(shared_histogram_info->metrics[metric]);
+
+	tmp = (metric_data *)palloc0(sizeof(metric_data));
+
+	tmp->unit = metric_info[metric].unit;
+	tmp->bins_count = METRIC_BINS_MAX;
+
+	tmp->count_data = (count_bin_t *) palloc(sizeof(count_bin_t) * (METRIC_BINS_MAX+1));
+	tmp->value_data =  (time_bin_t *) palloc(sizeof(time_bin_t)  * (METRIC_BINS_MAX+1));
+	tmp->time_data  =  (time_bin_t *) palloc(sizeof(time_bin_t)  * (METRIC_BINS_MAX+1));
+
+	/* we can do this using a shared lock */
+	LWLockAcquire(shared_histogram_info->lock, LW_SHARED);
+
+	memcpy(tmp->count_data, hist->count_bins, sizeof(count_bin_t) * (METRIC_BINS_MAX+1));
+	memcpy(tmp->value_data, hist->value_bins, sizeof(time_bin_t)  * (METRIC_BINS_MAX+1));
+	memcpy(tmp->time_data,  hist->time_bins,  sizeof(time_bin_t)  * (METRIC_BINS_MAX+1));
+
+	/* most metrics are sampled just like the queries (but not all) */
+	if (scale && metric_info[metric].sampled && (shared_histogram_info->sample_pct < 100))
+		coeff = (100.0 / (shared_histogram_info->sample_pct));
+
+	LWLockRelease(shared_histogram_info->lock);
+
+	for (i = 0; i < (METRIC_BINS_MAX+1); i++) {
+
+		if (coeff > 0) {
+			tmp->count_data[i] = tmp->count_data[i] * coeff;
+			tmp->value_data[i] = tmp->value_data[i] * coeff;
+			tmp->time_data[i]  = tmp->time_data[i] * coeff;
+		}
+
+		tmp->total_count += tmp->count_data[i];
+		tmp->total_value += tmp->value_data[i];
+		tmp->total_time  += tmp->time_data[i];
+	}
+
+	return tmp;
+}
+
+node_histogram_t *
+query_hist_get_node_data(bool scale)
+{
+	int i, j;
+	double coeff = 0;
+	node_histogram_t * tmp = NULL;
+
+	if (! shared_histogram_info) {
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("query_histogram must be loaded via shared_preload_libraries")));
+	}
+
+	tmp = (node_histogram_t *)palloc(sizeof(node_histogram_t) * NODE_TYPES_MAX);
+
+	/* we can do this using a shared lock */
+	LWLockAcquire(shared_histogram_info->lock, LW_SHARED);
+
+	memcpy(tmp, shared_histogram_info->nodes, sizeof(node_histogram_t) * NODE_TYPES_MAX);
+
+	/* the nodes are sub-sampled from the sampled queries (we assume the
+	 * node_sample_pct is the same in all the backends) */
+	if (scale && (default_histogram_node_sample_pct > 0))
+		coeff = (100.0 / (shared_histogram_info->sample_pct)) *
+				(100.0 / default_histogram_node_sample_pct);
+
+	LWLockRelease(shared_histogram_info->lock);
+
+	if (coeff > 0) {
+		for (i = 0; i < NODE_TYPES_MAX; i++) {
+			for (j = 0; j < NODE_BINS; j++) {
+				tmp[i].count_bins[j] = tmp[i].count_bins[j] * coeff;
+				tmp[i].time_bins[j]  = tmp[i].time_bins[j] * coeff;
+			}
+		}
+	}
+
+	return tmp;
+}
+
+heatmap_data *
+query_hist_get_heatmap_data(bool scale)
+{
+	int i, j;
+	double coeff = 0;
+	heatmap_data * tmp = NULL;
+
+	if (! shared_histogram_info) {
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("query_histogram must be loaded via shared_preload_libraries")));
+	}
+
+	tmp = (heatmap_data *)palloc(sizeof(heatmap_data));
+
+	/* we can do this using a shared lock */
+	LWLockAcquire(shared_histogram_info->lock, LW_SHARED);
+
+	memcpy(tmp->counts, shared_histogram_info->heatmap, sizeof(tmp->counts));
+
+	if (scale && (shared_histogram_info->sample_pct < 100))
+		coeff = (100.0 / (shared_histogram_info->sample_pct));
+
+	LWLockRelease(shared_histogram_info->lock);
+
+	if (coeff > 0) {
+		for (i = 0; i < HEATMAP_BINS; i++) {
+			for (j = 0; j < HEATMAP_BINS; j++) {
+				tmp->counts[i][j] = tmp->counts[i][j] * coeff;
+			}
+		}
+	}
+
+	return tmp;
+}
+
+concurrency_data *
+query_hist_get_concurrency_data(bool scale)
+{
+	int i, j;
+	double coeff = 0;
+	concurrency_data * tmp = NULL;
+
+	if (! shared_histogram_info) {
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("query_histogram must be loaded via shared_preload_libraries")));
+	}
+
+	tmp = (concurrency_data *)palloc(sizeof(concurrency_data));
+
+	/* we can do this using a shared lock */
+	LWLockAcquire(shared_histogram_info->lock, LW_SHARED);
+
+	memcpy(tmp->counts, shared_histogram_info->concurrency, sizeof(tmp->counts));
+
+	if (scale && (shared_histogram_info->sample_pct < 100))
+		coeff = (100.0 / (shared_histogram_info->sample_pct));
+
+	LWLockRelease(shared_histogram_info->lock);
+
+	if (coeff > 0) {
+		for (i = 0; i < HEATMAP_BINS; i++) {
+			for (j = 0; j < CONCURRENCY_BINS; j++) {
+				tmp->counts[i][j] = tmp->counts[i][j] * coeff;
+			}
+		}
+	}
+
+	return tmp;
+}
+
 static void
 set_histogram_bins_count_hook(int newval, void *extra)
 {
@@ -1036,10 +3161,83 @@ show_histogram_track_utility(void)
 		return "off";
 }
 
+/* parses the list of metrics into a bitmap (passed to the assign hook) */
+static bool
+check_histogram_metrics(char **newval, void **extra, GucSource source)
+{
+	char	   *rawstring;
+	List	   *elemlist;
+	ListCell   *l;
+	uint32		metrics = 0;
+	uint32	   *result;
+
+	rawstring = pstrdup(*newval);
+
+	if (! SplitIdentifierString(rawstring, ',', &elemlist)) {
+		GUC_check_errdetail("List syntax is invalid.");
+		pfree(rawstring);
+		list_free(elemlist);
+		return false;
+	}
+
+	foreach(l, elemlist)
+	{
+		char   *name = (char *) lfirst(l);
+		int		metric;
+
+		if (pg_strcasecmp(name, "all") == 0) {
+			metrics = (1 << METRIC_COUNT) - 1;
+			continue;
+		}
+
+		metric = get_metric_by_name(name);
+
+		if (metric < 0) {
+			GUC_check_errdetail("Unrecognized metric: \"%s\".", name);
+			pfree(rawstring);
+			list_free(elemlist);
+			return false;
+		}
+
+		metrics |= (1 << metric);
+	}
+
+	pfree(rawstring);
+	list_free(elemlist);
+
+	/* the extra value is freed by guc.c, so it must not be palloc'd (and
+	 * guc_malloc is exported only since 16) */
+#if (PG_VERSION_NUM >= 160000)
+	result = (uint32 *) guc_malloc(LOG, sizeof(uint32));
+	if (! result)
+		return false;
+#else
+	result = (uint32 *) malloc(sizeof(uint32));
+	if (! result) {
+		GUC_check_errcode(ERRCODE_OUT_OF_MEMORY);
+		GUC_check_errmsg("out of memory");
+		return false;
+	}
+#endif
+
+	*result = metrics;
+	*extra = result;
+
+	return true;
+}
+
+static void
+assign_histogram_metrics(const char *newval, void *extra)
+{
+	histogram_metrics = *((uint32 *) extra);
+}
+
+#if (PG_VERSION_NUM < 180000)
 static
 size_t get_histogram_size() {
 	return MAXALIGN(sizeof(histogram_info_t));
 }
+#endif
 
 /* The histogram is enabled when the number of bins is positive or when
  * the histogram is dynamic (in that case we can't rely on the bins number
@@ -2,6 +2,12 @@
 #include "tcop/utility.h"
 #include "utils/timestamp.h"
 #include "storage/lwlock.h"
+#include "nodes/plannodes.h"
+#include "nodes/execnodes.h"
+#include "executor/execdesc.h"
+#include "tcop/dest.h"
+#include "utils/guc.h"
+#include "portability/instr_time.h"
 
 /* TODO When the histogram is static (dynamic=0), we may actually
  *	  use less memory because the use can't resize it (so the
@@ -16,10 +22,206 @@ typedef enum {
 	HISTOGRAM_LOG
 } histogram_type_t;
 
+/* Clocks used to measure the durations (query_histogram.timing_method). */
+typedef enum {
+	TIMING_INSTR,
+	TIMING_COARSE,
+	TIMING_TSC
+} timing_method_t;
+
 /* data types used to store queries */
 typedef long long count_bin_t;
 typedef float8	time_bin_t;
 
+/* Additional per-query metrics, each collected into a separate histogram
+ * with logarithmic bins (enabled by query_histogram.metrics). */
+typedef enum {
+	METRIC_SHARED_BLKS_READ,
+	METRIC_SHARED_BLKS_HIT,
+	METRIC_TEMP_BLKS_WRITTEN,
+	METRIC_WAL_BYTES,
+	METRIC_IO_TIME,
+	METRIC_CPU_TIME,
+	METRIC_CPU_RATIO,
+	METRIC_MEMORY,
+	METRIC_JIT_TIME,
+	METRIC_COST_RATIO,
+	METRIC_ROWS_QERROR,
+	METRIC_FIRST_ROW_TIME,
+	METRIC_SEND_TIME,
+	METRIC_EXEC_TIME,
+	METRIC_COMMIT_WAL_TIME,
+	METRIC_COMMIT_NOWAL_TIME,
+	METRIC_IDLE_XACT_TIME,
+	METRIC_SESSION_TIME,
+	METRIC_COUNT		/* number of metrics, keep last */
+} histogram_metric_t;
+
+/* Number of bins of the metric histograms - the first bin is [0, unit),
+ * bin i is [unit * 2^(i-1), unit * 2^i), and the last one (METRIC_BINS_MAX)
+ * is for values that don't fit into the regular bins. */
+#define METRIC_BINS_MAX 64
+
+/* histogram of a single metric */
+typedef struct metric_histogram_t {
+
+	/* number of queries, sum of the metric and of query durations */
+	count_bin_t count_bins[METRIC_BINS_MAX+1];
+	time_bin_t  value_bins[METRIC_BINS_MAX+1];
+	time_bin_t  time_bins[METRIC_BINS_MAX+1];
+
+} metric_histogram_t;
+
+/* Number of bins (in each dimension) of the duration / rows heatmap. The
+ * bins are logarithmic - bin 0 is for zero, bin i for [2^(i-1), 2^i), and
+ * the last one includes all values that don't fit into the regular bins.
+ * The duration is in microseconds, so 32 bins cover ~18 minutes. */
+#define HEATMAP_BINS 32
+
+/* Number of concurrency bins of the duration / concurrency histogram (the
+ * concurrency bins are logarithmic too, the duration bins are the same as
+ * for the heatmap). */
+#define CONCURRENCY_BINS 16
+
+/* Number of bins of the per-plan histograms (logarithmic, in microseconds,
+ * the same as for the duration in the heatmap). */
+#define PLAN_BINS 32
+
+/* Maximum number of plan node types tracked in the per-node-type histograms
+ * (there are fewer plan node types than that), and the number of bins of
+ * those histograms (logarithmic, in microseconds). */
+#define NODE_TYPES_MAX 64
+#define NODE_BINS 32
+
+/* histogram of exclusive time of a plan node type (T_Invalid = unused) */
+typedef struct node_histogram_t {
+
+	NodeTag		tag;
+
+	count_bin_t count_bins[NODE_BINS];
+	time_bin_t  time_bins[NODE_BINS];
+
+} node_histogram_t;
+
+/* Maximum number of wait events tracked by the wait event sampling, and the
+ * number of bins of the wait duration histograms (logarithmic, in
+ * microseconds). */
+#define WAIT_EVENTS_MAX 256
+#define WAIT_BINS 32
+
+/* histogram of durations of a wait event (wait_event_info = 0 means unused) */
+typedef struct wait_histogram_t {
+
+	uint32		wait_event_info;
+
+	count_bin_t count_bins[WAIT_BINS];
+	time_bin_t  time_bins[WAIT_BINS];
+
+} wait_histogram_t;
+
+/* Maximum length of the query text kept for the slowest statements. */
+#define SLOWEST_QUERY_LEN 1024
+
+/* one of the slowest statements */
+typedef struct slow_query_t {
+
+	uint64		queryid;
+	Oid			dbid;
+	Oid			userid;
+
+	/* in seconds */
+	time_bin_t	duration;
+	TimestampTz	timestamp;
+
+	char		query[SLOWEST_QUERY_LEN];
+
+} slow_query_t;
+
+/* Maximum length of the captured plans (EXPLAIN output). */
+#define PLAN_CAPTURE_LEN 8192
+
+/* plan of a query that ended in one of the last bins */
+typedef struct captured_plan_t {
+
+	uint64		queryid;
+	Oid			dbid;
+
+	/* key of the rate limit (queryid, or the plan hash without queryid) */
+	uint64		key;
+
+	/* in seconds */
+	time_bin_t	duration;
+	TimestampTz	timestamp;
+
+	char		plan[PLAN_CAPTURE_LEN];
+
+} captured_plan_t;
+
+/* counters of the extension's own overhead (times in nanoseconds, only
+ * for the sampled lock acquisitions / hook calls) */
+typedef struct internal_stats_t {
+
+	uint64		recorded;
+	uint64		skipped;
+	uint64		lock_acquisitions;
+	uint64		lock_wait_samples;
+	uint64		lock_wait_time;
+	uint64		hook_calls;
+	uint64		hook_samples;
+	uint64		hook_time;
+
+} internal_stats_t;
+
+/* timer of the time spent in a hook (timed = sampled for timing) */
+typedef struct hook_timer_t {
+
+	bool		timed;
+	instr_time	start;
+	instr_time	total;
+
+} hook_timer_t;
+
+/* metrics of a single sampled query */
+typedef struct histogram_sample_t {
+
+	time_bin_t duration;
+
+	/* number of rows processed (-1 if not known, e.g. for utility) */
+	int64	   rows;
+
+	/* number of active backends when the query started (-1 if not known) */
+	int		   concurrency;
+
+	/* identification of the statement (for the exemplars) */
+	uint64	   queryid;
+	const char *query;
+
+	/* bitmap of metrics with valid values */
+	uint32	   metrics;
+	double	   values[METRIC_COUNT];
+
+	/* exclusive time (in seconds) by plan node type */
+	int		   nnodes;
+	NodeTag	   node_tags[NODE_TYPES_MAX];
+	double	   node_times[NODE_TYPES_MAX];
+
+} histogram_sample_t;
+
+/* Maximum length of the query text of the exemplars (including the '\0'). */
+#define EXEMPLAR_QUERY_LEN 128
+
+/* The most recent statement in a bin of the histogram. The exemplars are
+ * updated without any locking, so the fields may come from different
+ * statements (if two statements update the same bin at the same time). */
+typedef struct histogram_exemplar_t {
+
+	uint64		queryid;
+	int			pid;			/* 0 means the bin has no exemplar */
+	TimestampTz	timestamp;
+	char		query[EXEMPLAR_QUERY_LEN];
+
+} histogram_exemplar_t;
+
 /* used to transfer the data to the SRF */
 typedef struct histogram_data {
 
@@ -34,14 +236,68 @@ typedef struct histogram_data {
 	count_bin_t * count_data;
 	time_bin_t  * time_data;
 
+	/* exemplars for each bin (NULL if not available) */
+	histogram_exemplar_t * exemplars;
+
+	/* recorded (not scaled) counts and the sampling rate, only for
+	 * the scaled histogram (NULL otherwise) */
+	count_bin_t * sample_data;
+	int sample_pct;
+
 } histogram_data;
 
+/* used to transfer the metric histogram to the SRF */
+typedef struct metric_data {
+
+	/* upper boundary of the first bin */
+	double unit;
+
+	unsigned int bins_count;
+
+	count_bin_t total_count;
+	time_bin_t  total_value;
+	time_bin_t  total_time;
+
+	count_bin_t * count_data;
+	time_bin_t  * value_data;
+	time_bin_t  * time_data;
+
+} metric_data;
+
+/* used to transfer the heatmap to the SRF */
+typedef struct heatmap_data {
+
+	/* [duration bin][rows bin] */
+	count_bin_t counts[HEATMAP_BINS][HEATMAP_BINS];
+
+} heatmap_data;
+
+/* used to transfer the duration / concurrency histogram to the SRF */
+typedef struct concurrency_data {
+
+	/* [duration bin][concurrency bin] */
+	count_bin_t counts[HEATMAP_BINS][CONCURRENCY_BINS];
+
+} concurrency_data;
+
+/* per-plan histogram, used to transfer the data to the SRF */
+typedef struct plan_histogram_data {
+
+	Oid			dbid;
+	uint64		queryid;
+	uint64		planid;
+
+	count_bin_t count_bins[PLAN_BINS];
+	time_bin_t  time_bins[PLAN_BINS];
+
+} plan_histogram_data;
+
 /* shared segment struct with histogram info (initialized in
  * shmem_startup) */
 typedef struct histogram_info_t {
 
 	/* lock guarding the histogram */
-	LWLockId	lock;
+	LWLock	   *lock;
 
 	/* last histogram reset time */
 	TimestampTz  last_reset;
@@ -58,8 +314,115 @@ typedef struct histogram_info_t {
 	count_bin_t count_bins[HIST_BINS_MAX+1];
 	time_bin_t  time_bins[HIST_BINS_MAX+1];
 
+	/* histograms of the additional metrics */
+	metric_histogram_t metrics[METRIC_COUNT];
+
+	/* number of queries by duration and number of rows */
+	count_bin_t heatmap[HEATMAP_BINS][HEATMAP_BINS];
+
+	/* number of queries by duration and concurrency */
+	count_bin_t concurrency[HEATMAP_BINS][CONCURRENCY_BINS];
+
+	/* exclusive time by plan node type */
+	node_histogram_t nodes[NODE_TYPES_MAX];
+
 } histogram_info_t;
 
 histogram_data * query_hist_get_data(bool scale);
+histogram_data * query_hist_get_inflight_data(void);
+metric_data * query_hist_get_metric_data(const char * name, bool scale);
+heatmap_data * query_hist_get_heatmap_data(bool scale);
+concurrency_data * query_hist_get_concurrency_data(bool scale);
 void query_hist_reset(bool locked);
 TimestampTz get_hist_last_reset(void);
+int get_hist_sample_pct(void);
+int get_log2_bin(uint64 value, int bins);
+double query_hist_bin_lower(int type, int step, int bin);
+double query_hist_bin_upper(int type, int step, int bin);
+node_histogram_t * query_hist_get_node_data(bool scale);
+
+/* per-node-type histograms (queryhist_nodes.c) */
+void query_hist_collect_node_times(PlanState *planstate, histogram_sample_t *sample);
+void query_hist_add_node_times(node_histogram_t *nodes, histogram_sample_t *sample);
+void query_hist_merge_node_times(node_histogram_t *dst, node_histogram_t *src);
+const char * query_hist_node_name(NodeTag tag);
+
+/* DestReceiver wrapper (queryhist_dest.c) */
+typedef struct histogram_dest_t histogram_dest_t;
+
+histogram_dest_t * query_hist_dest_create(MemoryContext cxt, bool track_send, int timing_method);
+DestReceiver * query_hist_dest_wrap(histogram_dest_t *dest, DestReceiver *inner);
+double query_hist_dest_first_row(histogram_dest_t *dest);
+double query_hist_dest_send_time(histogram_dest_t *dest);
+
+/* per-plan histograms (queryhist_plans.c) */
+extern int query_histogram_max_plans;
+
+Size query_hist_plans_shmem_size(void);
+void query_hist_plans_shmem_startup(void);
+uint64 query_hist_plan_hash(PlannedStmt *stmt);
+void query_hist_plans_add(PlannedStmt *stmt, time_bin_t duration);
+void query_hist_plans_reset(void);
+bool query_hist_plans_query_data(uint64 queryid, count_bin_t *count_bins);
+plan_histogram_data * query_hist_get_plans_data(bool scale, int *nplans);
+
+/* wait event sampling (queryhist_waits.c) */
+extern int query_histogram_wait_sample_rate;
+
+Size query_hist_waits_shmem_size(void);
+void query_hist_waits_shmem_startup(void);
+void query_hist_waits_register_worker(void);
+bool query_hist_waits_check_rate(int *newval, void **extra, GucSource source);
+PGDLLEXPORT void query_hist_waits_main(Datum main_arg);
+void query_hist_waits_reset(void);
+wait_histogram_t * query_hist_get_wait_data(void);
+
+/* slowest statements (queryhist_slowest.c) */
+extern int query_histogram_slowest_count;
+
+Size query_hist_slowest_shmem_size(void);
+void query_hist_slowest_shmem_startup(void);
+void query_hist_slowest_add(uint64 queryid, const char *query, time_bin_t duration);
+void query_hist_slowest_reset(void);
+slow_query_t * query_hist_get_slowest_data(int *nqueries);
+
+/* plan capture (queryhist_capture.c) */
+extern int query_histogram_plan_capture_size;
+extern int query_histogram_plan_capture_interval;
+
+Size query_hist_capture_shmem_size(void);
+void query_hist_capture_shmem_startup(void);
+void query_hist_capture_plan(QueryDesc *queryDesc, bool analyze, time_bin_t duration);
+void query_hist_capture_reset(void);
+captured_plan_t * query_hist_get_captured_plans(int *nplans);
+
+/* self-instrumentation (queryhist_internal.c) */
+Size query_hist_internal_shmem_size(void);
+void query_hist_internal_shmem_startup(void);
+void query_hist_internal_statement(bool recorded);
+void query_hist_lock_acquire(LWLock *lock, LWLockMode mode);
+void query_hist_lock_acquired(void);
+void query_hist_timer_start(hook_timer_t *timer);
+void query_hist_timer_pause(hook_timer_t *timer);
+void query_hist_timer_resume(hook_timer_t *timer);
+void query_hist_timer_stop(hook_timer_t *timer);
+void query_hist_internal_reset(void);
+internal_stats_t * query_hist_get_internal_stats(void);
+
+/* clocks (queryhist_clock.c) */
+extern int query_histogram_timing_method;
+
+bool query_hist_clock_calibrate(void);
+double query_hist_clock_read(int method);
+double query_hist_clock_elapsed(int method, double start);
+bool query_hist_clock_available(int method);
+double query_hist_clock_resolution(int method);
+double query_hist_clock_bench(int method, int loops);
+
+/* confidence intervals of the sampled data (queryhist_ci.c) */
+#define HISTOGRAM_CI_CONFIDENCE		0.95
+
+void query_hist_count_interval(count_bin_t sampled, int sample_pct, double confidence,
+							   double *low, double *high);
+bool query_hist_percentile(histogram_data *data, double fraction, double confidence,
+						   double *value, double *low, double *high);
@@ -0,0 +1,206 @@
+#include "postgres.h"
+#include "miscadmin.h"
+#include "commands/explain.h"
+#if (PG_VERSION_NUM >= 180000)
+#include "commands/explain_format.h"
+#include "commands/explain_state.h"
+#endif
+#include "mb/pg_wchar.h"
+#include "storage/ipc.h"
+#include "storage/shmem.h"
+
+#include "queryhist.h"
+
+/*
+ * Automatic capture of plans of the slowest queries, i.e. queries that end
+ * in the last few bins of the histogram (query_histogram.plan_capture_bins)
+ * or in the overflow bin. The plans (EXPLAIN output, built from the QueryDesc
+ * of the query) are stored in a shared ring buffer with a fixed number of
+ * entries (query_histogram.plan_capture_size), so the oldest plans get
+ * overwritten by new ones.
+ *
+ * Each queryId is captured at most once per query_histogram.plan_capture_interval,
+ * so that a single query that is often slow does not push out everything
+ * else. This is checked by looking for a recent entry with the same queryId
+ * in the ring buffer (which is small, so that's cheap enough). When the
+ * queryId is not computed (compute_query_id = off without pg_stat_statements)
+ * all queries have queryId 0, so the hash of the plan shape (the same as
+ * for the per-plan histograms) is used instead - otherwise the whole
+ * cluster would capture a single plan per interval.
+ *
+ * The plans include actual times and rows only if the query had per-node
+ * instrumentation (see query_histogram.node_sample_pct), as we don't want
+ * to instrument every query just in case it gets slow.
+ */
+
+/* number of plans in the ring buffer (zero means disabled) */
+int query_histogram_plan_capture_size = 0;
+
+/* minimum interval between captures for the same queryId (seconds) */
+int query_histogram_plan_capture_interval = 60;
+
+typedef struct plan_capture_info_t {
+
+	/* lock guarding the ring buffer */
+	LWLock	   *lock;
+
+	/* number of plans captured so far (the next slot is next % size) */
+	uint64		next;
+
+	captured_plan_t plans[FLEXIBLE_ARRAY_MEMBER];
+
+} plan_capture_info_t;
+
+static plan_capture_info_t * shared_capture_info = NULL;
+
+static bool capture_recently_captured(uint64 key, TimestampTz now);
+
+Size
+query_hist_capture_shmem_size()
+{
+	return MAXALIGN(add_size(offsetof(plan_capture_info_t, plans),
+							 mul_size(query_histogram_plan_capture_size, sizeof(captured_plan_t))));
+}
+
+void
+query_hist_capture_shmem_startup()
+{
+	bool		found;
+
+	if (query_histogram_plan_capture_size == 0)
+		return;
+
+	LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+
+	shared_capture_info = ShmemInitStruct("query_histogram_capture",
+										  query_hist_capture_shmem_size(),
+										  &found);
+
+	if (! found) {
+		shared_capture_info->lock = &(GetNamedLWLockTranche("query_histogram_capture"))->lock;
+		shared_capture_info->next = 0;
+	}
+
+	LWLockRelease(AddinShmemInitLock);
+}
+
+/* was the queryId (or plan) captured recently? (needs to be locked) */
+static bool
+capture_recently_captured(uint64 key, TimestampTz now)
+{
+	int			i;
+	int			nplans = Min(shared_capture_info->next, query_histogram_plan_capture_size);
+
+	for (i = 0; i < nplans; i++)
+	{
+		captured_plan_t *plan = &(shared_capture_info->plans[i]);
+
+		if ((plan->key == key) &&
+			! TimestampDifferenceExceeds(plan->timestamp, now,
+										 query_histogram_plan_capture_interval * 1000))
+			return true;
+	}
+
+	return false;
+}
+
+/* captures the plan of the query (unless captured recently) */
+void
+query_hist_capture_plan(QueryDesc *queryDesc, bool analyze, time_bin_t duration)
+{
+	uint64		queryid = (uint64) queryDesc->plannedstmt->queryId;
+	uint64		key;
+	TimestampTz	now = GetCurrentTimestamp();
+	ExplainState *es;
+	captured_plan_t *plan;
+	int			len;
+	bool		recent;
+
+	if (! shared_capture_info)
+		return;
+
+	/* without a queryId, rate-limit by the plan shape */
+	key = (queryid != 0) ? queryid : query_hist_plan_hash(queryDesc->plannedstmt);
+
+	/* check the rate limit first, building the EXPLAIN is not cheap */
+	LWLockAcquire(shared_capture_info->lock, LW_SHARED);
+	recent = capture_recently_captured(key, now);
+	LWLockRelease(shared_capture_info->lock);
+
+	if (recent)
+		return;
+
+	es = NewExplainState();
+
+	es->analyze = analyze;
+	es->timing = analyze;
+	es->format = EXPLAIN_FORMAT_TEXT;
+
+	ExplainBeginOutput(es);
+	ExplainQueryText(es, queryDesc);
+	ExplainPrintPlan(es, queryDesc);
+	ExplainEndOutput(es);
+
+	/* don't cut the plan in the middle of a multi-byte character */
+	len = es->str->len;
+	if (len >= PLAN_CAPTURE_LEN)
+		len = pg_mbcliplen(es->str->data, len, PLAN_CAPTURE_LEN - 1);
+
+	LWLockAcquire(shared_capture_info->lock, LW_EXCLUSIVE);
+
+	/* someone else might have captured the same query in the meantime */
+	if (! capture_recently_captured(key, now))
+	{
+		plan = &(shared_capture_info->plans[shared_capture_info->next % query_histogram_plan_capture_size]);
+		shared_capture_info->next++;
+
+		plan->queryid = queryid;
+		plan->key = key;
+		plan->dbid = MyDatabaseId;
+		plan->duration = duration;
+		plan->timestamp = now;
+
+		memcpy(plan->plan, es->str->data, len);
+		plan->plan[len] = '\0';
+	}
+
+	LWLockRelease(shared_capture_info->lock);
+
+	pfree(es->str->data);
+	pfree(es);
+}
+
+void
+query_hist_capture_reset()
+{
+	if (! shared_capture_info)
+		return;
+
+	LWLockAcquire(shared_capture_info->lock, LW_EXCLUSIVE);
+	shared_capture_info->next = 0;
+	LWLockRelease(shared_capture_info->lock);
+}
+
+/* copy of the captured plans (in no particular order) */
+captured_plan_t *
+query_hist_get_captured_plans(int *nplans)
+{
+	captured_plan_t *data;
+
+	if (! shared_capture_info) {
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("plan capture is disabled (query_histogram.plan_capture_size=0)")));
+	}
+
+	data = (captured_plan_t *) palloc(sizeof(captured_plan_t) * query_histogram_plan_capture_size);
+
+	LWLockAcquire(shared_capture_info->lock, LW_SHARED);
+
+	*nplans = Min(shared_capture_info->next, query_histogram_plan_capture_size);
+	memcpy(data, shared_capture_info->plans, sizeof(captured_plan_t) * (*nplans));
+
+	LWLockRelease(shared_capture_info->lock);
+
+	return data;
+}
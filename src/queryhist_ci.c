@@ -0,0 +1,185 @@
+#include <math.h>
+
+#include "postgres.h"
+
+#include "queryhist.h"
+
+/*
+ * Confidence intervals of the values estimated from the sampled queries.
+ *
+ * With sample_pct < 100 each statement is recorded with probability
+ * p = sample_pct/100 (independently of the other statements), and the
+ * scaled histogram reports k/p for a bin with k recorded statements. That
+ * is only a point estimate, and with a low sampling rate the tail bins
+ * (which are the interesting ones) often have just a couple statements.
+ *
+ * Per-bin intervals - the recorded count k is binomial B(N, p), with the
+ * unknown N the value we're estimating. For small p that's approximately
+ * Poisson, so we use the (exact) Garwood interval for the Poisson mean,
+ * scale it by 1/p, and shrink it by sqrt(1-p) (the variance of the
+ * binomial is Np(1-p), not Np), so that with sample_pct = 100 the interval
+ * is just the count. The lower bound is never below k, as we know at least
+ * k statements ended in the bin.
+ *
+ * Percentiles - the sampled statements are a random sample of all the
+ * statements, so the rank of the q-th quantile among the n recorded ones
+ * is approximately normal with mean nq and variance nq(1-q) - this is the
+ * usual distribution-free interval for quantiles, with the same sqrt(1-p)
+ * correction. The ranks are then translated to durations by linear
+ * interpolation within the bin.
+ *
+ * The quantiles of the normal / chi-square distributions are computed
+ * using approximations that are good enough for this purpose (we're
+ * talking about a couple digits at most).
+ */
+
+static double normal_quantile(double p);
+static double chisq_quantile(double p, double df);
+static double bin_lower(histogram_data *data, int bin);
+static double bin_upper(histogram_data *data, int bin);
+static double rank_to_value(histogram_data *data, double rank);
+
+/*
+ * Quantile of the standard normal distribution (Abramowitz & Stegun,
+ * 26.2.23, the absolute error is less than 4.5e-4).
+ */
+static double
+normal_quantile(double p)
+{
+	double		t;
+	double		z;
+
+	Assert((p > 0) && (p < 1));
+
+	t = sqrt(-2.0 * log((p < 0.5) ? p : (1 - p)));
+
+	z = t - (2.515517 + 0.802853 * t + 0.010328 * t * t) /
+			(1.0 + 1.432788 * t + 0.189269 * t * t + 0.001308 * t * t * t);
+
+	return (p < 0.5) ? -z : z;
+}
+
+/* Quantile of the chi-square distribution (Wilson-Hilferty) */
+static double
+chisq_quantile(double p, double df)
+{
+	double		a = 2.0 / (9.0 * df);
+	double		x = 1.0 - a + normal_quantile(p) * sqrt(a);
+
+	return (x > 0) ? df * x * x * x : 0;
+}
+
+/*
+ * Confidence interval for the number of statements in a bin with 'sampled'
+ * recorded statements (in the same scale as query_hist_get_data(true)).
+ */
+void
+query_hist_count_interval(count_bin_t sampled, int sample_pct, double confidence,
+						  double *low, double *high)
+{
+	double		p = sample_pct / 100.0;
+	double		alpha = 1.0 - confidence;
+	double		shrink = sqrt(1.0 - p);
+	double		k = sampled;
+	double		lambda_low,
+				lambda_high;
+
+	/* everything recorded, so the count is exact */
+	if (sample_pct >= 100) {
+		*low = *high = k;
+		return;
+	}
+
+	/* Garwood interval (for k = 0 the upper bound is exact) */
+	if (sampled == 0) {
+		lambda_low = 0;
+		lambda_high = -log(alpha / 2);
+	} else {
+		lambda_low = chisq_quantile(alpha / 2, 2 * k) / 2;
+		lambda_high = chisq_quantile(1 - alpha / 2, 2 * k + 2) / 2;
+	}
+
+	*low = Max(k, (k - (k - lambda_low) * shrink) / p);
+	*high = (k + (lambda_high - k) * shrink) / p;
+}
+
+/* bin boundaries, the same as returned by query_histogram() */
+static double
+bin_lower(histogram_data *data, int bin)
+{
+	return query_hist_bin_lower(data->histogram_type, data->bins_width, bin);
+}
+
+static double
+bin_upper(histogram_data *data, int bin)
+{
+	return query_hist_bin_upper(data->histogram_type, data->bins_width, bin);
+}
+
+/*
+ * Duration (in ms) of the statement with the given rank among the recorded
+ * ones, interpolated within the bin. The last bin is not bounded, so for
+ * ranks in that bin we return the lower boundary of the bin.
+ */
+static double
+rank_to_value(histogram_data *data, double rank)
+{
+	int			i;
+	double		cumulative = 0;
+	int			last = -1;
+
+	for (i = 0; i <= data->bins_count; i++) {
+
+		count_bin_t count = data->sample_data[i];
+
+		if (count == 0)
+			continue;
+
+		last = i;
+
+		if (rank <= cumulative + count)
+			break;
+
+		cumulative += count;
+	}
+
+	Assert(last >= 0);
+
+	if (last == data->bins_count)
+		return bin_lower(data, last);
+
+	return bin_lower(data, last) +
+		   (bin_upper(data, last) - bin_lower(data, last)) *
+		   Max(0, rank - cumulative) / data->sample_data[last];
+}
+
+/*
+ * Estimates the given quantile of the query duration (in ms), including
+ * the confidence interval. Returns false if there are no recorded queries.
+ */
+bool
+query_hist_percentile(histogram_data *data, double fraction, double confidence,
+					  double *value, double *low, double *high)
+{
+	int			i;
+	double		n = 0;
+	double		halfwidth;
+
+	Assert(data->sample_data != NULL);
+
+	for (i = 0; i <= data->bins_count; i++)
+		n += data->sample_data[i];
+
+	if (n == 0)
+		return false;
+
+	halfwidth = normal_quantile(1 - (1 - confidence) / 2) *
+				sqrt(n * fraction * (1 - fraction)) *
+				sqrt(1 - data->sample_pct / 100.0);
+
+	*value = rank_to_value(data, n * fraction);
+	*low = rank_to_value(data, Max(0, n * fraction - halfwidth));
+	*high = rank_to_value(data, Min(n, n * fraction + halfwidth));
+
+	return true;
+}
@@ -0,0 +1,227 @@
+#include <time.h>
+
+#include "postgres.h"
+#include "miscadmin.h"
+#include "portability/instr_time.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <x86intrin.h>
+#define HAVE_QUERYHIST_TSC
+#endif
+
+#include "queryhist.h"
+
+/*
+ * Clock used to measure durations of the sampled queries and of utility
+ * statements (query_histogram.timing_method):
+ *
+ *   instr  - the executor instrumentation (instr_time), i.e. whatever the
+ *            server uses for EXPLAIN ANALYZE (usually CLOCK_MONOTONIC)
+ *
+ *   coarse - CLOCK_MONOTONIC_COARSE, which does not need to read the
+ *            hardware clock, so it's cheap even when the clocksource is
+ *            slow (e.g. on some VMs), but the resolution is only a few ms
+ *            (the jiffy)
+ *
+ *   tsc    - the CPU time-stamp counter (rdtsc), converted to seconds using
+ *            a frequency calibrated against CLOCK_MONOTONIC - only on x86
+ *            with invariant TSC, otherwise we fall back to instr
+ *
+ * query_histogram_clock_bench() measures the cost of reading each clock,
+ * so it's possible to decide whether the lower precision is worth it.
+ */
+
+int query_histogram_timing_method = TIMING_INSTR;
+
+/* length of the TSC calibration (in ms) */
+#define TSC_CALIBRATION_MS	10
+
+/* 0 - not calibrated yet, -1 - not available */
+static double tsc_seconds_per_cycle = 0;
+
+static double clock_monotonic(clockid_t clock);
+
+#ifdef HAVE_QUERYHIST_TSC
+/* checks the TSC is invariant (constant rate in all C/P-states) */
+static bool
+tsc_is_invariant(void)
+{
+	unsigned int eax, ebx, ecx, edx;
+
+	if (! __get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx))
+		return false;
+
+	return ((edx & (1 << 8)) != 0);
+}
+#endif
+
+static double
+clock_monotonic(clockid_t clock)
+{
+	struct timespec ts;
+
+	clock_gettime(clock, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+/*
+ * Calibrates the TSC frequency against CLOCK_MONOTONIC (busy-waits for
+ * a couple milliseconds), returns false if the TSC is not usable. Done in
+ * the postmaster from _PG_init (so the backends inherit the result), and
+ * otherwise on the first use.
+ */
+bool
+query_hist_clock_calibrate(void)
+{
+#ifdef HAVE_QUERYHIST_TSC
+	double		start, end;
+	uint64		cycles_start, cycles_end;
+
+	if (tsc_seconds_per_cycle != 0)
+		return (tsc_seconds_per_cycle > 0);
+
+	if (! tsc_is_invariant()) {
+		tsc_seconds_per_cycle = -1;
+		return false;
+	}
+
+	start = clock_monotonic(CLOCK_MONOTONIC);
+	cycles_start = __rdtsc();
+
+	do {
+		end = clock_monotonic(CLOCK_MONOTONIC);
+	} while (end - start < TSC_CALIBRATION_MS / 1000.0);
+
+	cycles_end = __rdtsc();
+
+	if (cycles_end <= cycles_start) {
+		tsc_seconds_per_cycle = -1;
+		return false;
+	}
+
+	tsc_seconds_per_cycle = (end - start) / (cycles_end - cycles_start);
+
+	return true;
+#else
+	tsc_seconds_per_cycle = -1;
+	return false;
+#endif
+}
+
+/* current time (in seconds) using the clock */
+double
+query_hist_clock_read(int method)
+{
+	instr_time	now;
+
+	switch (method)
+	{
+#ifdef CLOCK_MONOTONIC_COARSE
+		case TIMING_COARSE:
+			return clock_monotonic(CLOCK_MONOTONIC_COARSE);
+#endif
+
+#ifdef HAVE_QUERYHIST_TSC
+		case TIMING_TSC:
+			if ((tsc_seconds_per_cycle > 0) || query_hist_clock_calibrate())
+				return __rdtsc() * tsc_seconds_per_cycle;
+			break;
+#endif
+
+		default:
+			break;
+	}
+
+	INSTR_TIME_SET_CURRENT(now);
+
+	return INSTR_TIME_GET_DOUBLE(now);
+}
+
+/*
+ * Time elapsed since the start (in seconds), both read using the clock. The
+ * TSC may go backwards when the process moves to another CPU (e.g. on VMs
+ * that report invariant TSC without synchronizing it across the vCPUs),
+ * so never return a negative value.
+ */
+double
+query_hist_clock_elapsed(int method, double start)
+{
+	double		elapsed = query_hist_clock_read(method) - start;
+
+	return (elapsed > 0) ? elapsed : 0;
+}
+
+/* is the clock available on this system? */
+bool
+query_hist_clock_available(int method)
+{
+	switch (method)
+	{
+		case TIMING_INSTR:
+			return true;
+
+		case TIMING_COARSE:
+#ifdef CLOCK_MONOTONIC_COARSE
+			return true;
+#else
+			return false;
+#endif
+
+		case TIMING_TSC:
+			return query_hist_clock_calibrate();
+	}
+
+	return false;
+}
+
+/* resolution of the clock (in seconds), 0 if unknown */
+double
+query_hist_clock_resolution(int method)
+{
+	struct timespec ts;
+
+	switch (method)
+	{
+		case TIMING_INSTR:
+			if (clock_getres(CLOCK_MONOTONIC, &ts) == 0)
+				return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+			break;
+
+		case TIMING_COARSE:
+#ifdef CLOCK_MONOTONIC_COARSE
+			if (clock_getres(CLOCK_MONOTONIC_COARSE, &ts) == 0)
+				return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+#endif
+			break;
+
+		case TIMING_TSC:
+			if (query_hist_clock_calibrate())
+				return tsc_seconds_per_cycle;
+			break;
+	}
+
+	return 0;
+}
+
+/* average cost of reading the clock (in seconds), -1 if not available */
+double
+query_hist_clock_bench(int method, int loops)
+{
+	int			i;
+	double		start, end;
+	volatile double value = 0;
+
+	if (! query_hist_clock_available(method))
+		return -1;
+
+	start = clock_monotonic(CLOCK_MONOTONIC);
+
+	for (i = 0; i < loops; i++)
+		value += query_hist_clock_read(method);
+
+	end = clock_monotonic(CLOCK_MONOTONIC);
+
+	return (end - start) / loops;
+}
@@ -0,0 +1,192 @@
+#include "postgres.h"
+
+#include "executor/tuptable.h"
+#include "tcop/dest.h"
+
+#include "queryhist.h"
+
+/*
+ * DestReceiver wrapping the actual receiver of a sampled query, used to
+ * measure the time to the first row (i.e. the latency as perceived by the
+ * client, e.g. for cursors and streaming). The start is the beginning of
+ * the first ExecutorRun call.
+ *
+ * The first receiveSlot call records the timestamp and then replaces itself
+ * with a plain forwarding function, so the rows after the first one pay only
+ * for one additional (indirect) function call.
+ *
+ * Optionally, the wrapper also measures time spent in the receiver (i.e.
+ * sending the rows to the client), to expose slow clients. Timing every row
+ * would be expensive, so only every SEND_TIME_SAMPLE_ROWS-th row is timed
+ * and the time is multiplied accordingly.
+ *
+ * The wrapper is installed in ExecutorRun (and not in ExecutorStart), because
+ * portals set queryDesc->dest just before running the executor.
+ *
+ * All the timing uses the same clock as the duration of the statement
+ * (timing_method, as read in ExecutorStart), because the execution time is
+ * computed as the duration minus the send time. With the coarse clock the
+ * individual timed rows mostly read as 0 or a whole jiffy, so the send time
+ * of statements shorter than a couple jiffies is very imprecise.
+ */
+#define SEND_TIME_SAMPLE_ROWS	16
+
+struct histogram_dest_t {
+
+	DestReceiver	pub;
+
+	/* the actual receiver (may change between ExecutorRun calls) */
+	DestReceiver   *inner;
+
+	/* clock used for all the timing (see query_hist_clock_read) */
+	int				timing_method;
+
+	/* start of the first ExecutorRun */
+	bool			started;
+	double			start;
+
+	/* time to the first row (in seconds), or -1 if no row yet */
+	double			first_row;
+
+	/* (estimated) time spent in the inner receiver, in seconds */
+	bool			track_send;
+	uint64			rows;
+	double			send_time;
+
+};
+
+static bool histogram_dest_receive_first(TupleTableSlot *slot, DestReceiver *self);
+static bool histogram_dest_receive(TupleTableSlot *slot, DestReceiver *self);
+static bool histogram_dest_receive_timed(TupleTableSlot *slot, DestReceiver *self);
+static void histogram_dest_startup(DestReceiver *self, int operation, TupleDesc typeinfo);
+static void histogram_dest_shutdown(DestReceiver *self);
+static void histogram_dest_destroy(DestReceiver *self);
+
+/* the first row - record the time and switch to the forwarding function */
+static bool
+histogram_dest_receive_first(TupleTableSlot *slot, DestReceiver *self)
+{
+	histogram_dest_t *dest = (histogram_dest_t *) self;
+
+	dest->first_row = query_hist_clock_elapsed(dest->timing_method, dest->start);
+
+	if (dest->track_send) {
+
+		double		start;
+		bool		result;
+
+		dest->pub.receiveSlot = histogram_dest_receive_timed;
+		dest->rows = 1;
+
+		start = query_hist_clock_read(dest->timing_method);
+		result = dest->inner->receiveSlot(slot, dest->inner);
+
+		dest->send_time += query_hist_clock_elapsed(dest->timing_method, start);
+
+		return result;
+	}
+
+	dest->pub.receiveSlot = histogram_dest_receive;
+
+	return dest->inner->receiveSlot(slot, dest->inner);
+}
+
+/* times every SEND_TIME_SAMPLE_ROWS-th row, and extrapolates */
+static bool
+histogram_dest_receive_timed(TupleTableSlot *slot, DestReceiver *self)
+{
+	histogram_dest_t *dest = (histogram_dest_t *) self;
+	double		start;
+	bool		result;
+
+	if ((++dest->rows % SEND_TIME_SAMPLE_ROWS) != 0)
+		return dest->inner->receiveSlot(slot, dest->inner);
+
+	start = query_hist_clock_read(dest->timing_method);
+	result = dest->inner->receiveSlot(slot, dest->inner);
+
+	dest->send_time += query_hist_clock_elapsed(dest->timing_method, start) *
+					   SEND_TIME_SAMPLE_ROWS;
+
+	return result;
+}
+
+static bool
+histogram_dest_receive(TupleTableSlot *slot, DestReceiver *self)
+{
+	histogram_dest_t *dest = (histogram_dest_t *) self;
+
+	return dest->inner->receiveSlot(slot, dest->inner);
+}
+
+static void
+histogram_dest_startup(DestReceiver *self, int operation, TupleDesc typeinfo)
+{
+	histogram_dest_t *dest = (histogram_dest_t *) self;
+
+	dest->inner->rStartup(dest->inner, operation, typeinfo);
+}
+
+static void
+histogram_dest_shutdown(DestReceiver *self)
+{
+	histogram_dest_t *dest = (histogram_dest_t *) self;
+
+	dest->inner->rShutdown(dest->inner);
+}
+
+/* the inner receiver is owned by someone else, so don't destroy it */
+static void
+histogram_dest_destroy(DestReceiver *self)
+{
+}
+
+/* Creates the wrapper (in the per-query memory context), timed using the
+ * clock of the statement. */
+histogram_dest_t *
+query_hist_dest_create(MemoryContext cxt, bool track_send, int timing_method)
+{
+	histogram_dest_t *dest;
+
+	dest = (histogram_dest_t *) MemoryContextAllocZero(cxt, sizeof(histogram_dest_t));
+
+	dest->pub.receiveSlot = histogram_dest_receive_first;
+	dest->pub.rStartup = histogram_dest_startup;
+	dest->pub.rShutdown = histogram_dest_shutdown;
+	dest->pub.rDestroy = histogram_dest_destroy;
+
+	dest->first_row = -1;
+	dest->track_send = track_send;
+	dest->timing_method = timing_method;
+
+	return dest;
+}
+
+/* Wraps the receiver for the ExecutorRun call, returns the wrapper. */
+DestReceiver *
+query_hist_dest_wrap(histogram_dest_t *dest, DestReceiver *inner)
+{
+	if (! dest->started) {
+		dest->start = query_hist_clock_read(dest->timing_method);
+		dest->started = true;
+	}
+
+	dest->inner = inner;
+	dest->pub.mydest = inner->mydest;
+
+	return (DestReceiver *) dest;
+}
+
+/* Returns the time to the first row (in seconds), or -1 if there was none. */
+double
+query_hist_dest_first_row(histogram_dest_t *dest)
+{
+	return dest->first_row;
+}
+
+/* Returns the (estimated) time spent sending the rows, in seconds. */
+double
+query_hist_dest_send_time(histogram_dest_t *dest)
+{
+	return dest->send_time;
+}
@@ -0,0 +1,269 @@
+#include "postgres.h"
+#include "miscadmin.h"
+#include "port/atomics.h"
+#include "portability/instr_time.h"
+#include "storage/ipc.h"
+#include "storage/shmem.h"
+
+#include "queryhist.h"
+
+/*
+ * Counters of the extension's own overhead - how many statements were
+ * recorded / skipped (not sampled), how many times the histogram lock was
+ * acquired, how long we waited for it, and how much time was spent in the
+ * hooks (not counting the executor / utility code the hooks call).
+ *
+ * Measuring the time for every call would add quite a bit of overhead on
+ * its own (and on some systems reading the clock is not cheap), so only
+ * one in INTERNAL_TIMING_SAMPLE lock acquisitions / hook calls is timed,
+ * and the totals are estimated from those.
+ *
+ * The counters are accumulated in a backend-local struct, and added to the
+ * shared (atomic) counters once in a while, so that we don't add contention
+ * on yet another shared cache line for each statement.
+ */
+
+/* one in this many lock acquisitions / hook calls is timed */
+#define INTERNAL_TIMING_SAMPLE	16
+
+/* flush the local counters after this many statements */
+#define INTERNAL_FLUSH_STATEMENTS	64
+
+/* the waits are mostly very short, so we need nanoseconds */
+#if (PG_VERSION_NUM >= 160000)
+#define INSTR_TIME_GET_NS(t)	INSTR_TIME_GET_NANOSEC(t)
+#else
+#define INSTR_TIME_GET_NS(t)	((uint64) (INSTR_TIME_GET_DOUBLE(t) * 1000000000.0))
+#endif
+
+typedef struct internal_counters_t {
+
+	pg_atomic_uint64	recorded;
+	pg_atomic_uint64	skipped;
+	pg_atomic_uint64	lock_acquisitions;
+	pg_atomic_uint64	lock_wait_samples;
+	pg_atomic_uint64	lock_wait_time;		/* nanoseconds */
+	pg_atomic_uint64	hook_calls;
+	pg_atomic_uint64	hook_samples;
+	pg_atomic_uint64	hook_time;			/* nanoseconds */
+
+} internal_counters_t;
+
+static internal_counters_t * shared_internal = NULL;
+
+/* backend-local counters, not yet added to the shared ones */
+static internal_stats_t pending_internal;
+static bool pending_registered = false;
+
+static void internal_flush(void);
+static void internal_exit_callback(int code, Datum arg);
+static void internal_pending_added(void);
+
+Size
+query_hist_internal_shmem_size()
+{
+	return MAXALIGN(sizeof(internal_counters_t));
+}
+
+void
+query_hist_internal_shmem_startup()
+{
+	bool		found;
+
+	LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+
+	shared_internal = ShmemInitStruct("query_histogram_internal",
+									  sizeof(internal_counters_t),
+									  &found);
+
+	if (! found) {
+		pg_atomic_init_u64(&(shared_internal->recorded), 0);
+		pg_atomic_init_u64(&(shared_internal->skipped), 0);
+		pg_atomic_init_u64(&(shared_internal->lock_acquisitions), 0);
+		pg_atomic_init_u64(&(shared_internal->lock_wait_samples), 0);
+		pg_atomic_init_u64(&(shared_internal->lock_wait_time), 0);
+		pg_atomic_init_u64(&(shared_internal->hook_calls), 0);
+		pg_atomic_init_u64(&(shared_internal->hook_samples), 0);
+		pg_atomic_init_u64(&(shared_internal->hook_time), 0);
+	}
+
+	LWLockRelease(AddinShmemInitLock);
+}
+
+/* adds the local counters to the shared ones */
+static void
+internal_flush()
+{
+	if (! shared_internal)
+		return;
+
+	pg_atomic_fetch_add_u64(&(shared_internal->recorded), pending_internal.recorded);
+	pg_atomic_fetch_add_u64(&(shared_internal->skipped), pending_internal.skipped);
+	pg_atomic_fetch_add_u64(&(shared_internal->lock_acquisitions), pending_internal.lock_acquisitions);
+	pg_atomic_fetch_add_u64(&(shared_internal->lock_wait_samples), pending_internal.lock_wait_samples);
+	pg_atomic_fetch_add_u64(&(shared_internal->lock_wait_time), pending_internal.lock_wait_time);
+	pg_atomic_fetch_add_u64(&(shared_internal->hook_calls), pending_internal.hook_calls);
+	pg_atomic_fetch_add_u64(&(shared_internal->hook_samples), pending_internal.hook_samples);
+	pg_atomic_fetch_add_u64(&(shared_internal->hook_time), pending_internal.hook_time);
+
+	memset(&pending_internal, 0, sizeof(internal_stats_t));
+}
+
+/* before_shmem_exit callback, so that the last few statements are not lost */
+static void
+internal_exit_callback(int code, Datum arg)
+{
+	internal_flush();
+}
+
+/* makes sure the pending counters get flushed when the backend exits */
+static void
+internal_pending_added()
+{
+	if (! pending_registered) {
+		before_shmem_exit(internal_exit_callback, (Datum) 0);
+		pending_registered = true;
+	}
+}
+
+/* counts a top-level statement (recorded = sampled) */
+void
+query_hist_internal_statement(bool recorded)
+{
+	internal_pending_added();
+
+	if (recorded)
+		pending_internal.recorded++;
+	else
+		pending_internal.skipped++;
+
+	if (pending_internal.recorded + pending_internal.skipped >= INTERNAL_FLUSH_STATEMENTS)
+		internal_flush();
+}
+
+/* acquires the histogram lock, and (sometimes) measures the wait */
+void
+query_hist_lock_acquire(LWLock *lock, LWLockMode mode)
+{
+	instr_time	start,
+				end;
+
+	internal_pending_added();
+
+	if (++pending_internal.lock_acquisitions % INTERNAL_TIMING_SAMPLE != 0) {
+		LWLockAcquire(lock, mode);
+		return;
+	}
+
+	INSTR_TIME_SET_CURRENT(start);
+	LWLockAcquire(lock, mode);
+	INSTR_TIME_SET_CURRENT(end);
+
+	INSTR_TIME_SUBTRACT(end, start);
+
+	pending_internal.lock_wait_samples++;
+	pending_internal.lock_wait_time += INSTR_TIME_GET_NS(end);
+}
+
+/* counts the lock acquired in some other way (e.g. conditionally) */
+void
+query_hist_lock_acquired(void)
+{
+	internal_pending_added();
+
+	pending_internal.lock_acquisitions++;
+}
+
+/* starts a hook timer (decides whether this call gets timed) */
+void
+query_hist_timer_start(hook_timer_t *timer)
+{
+	timer->timed = (++pending_internal.hook_calls % INTERNAL_TIMING_SAMPLE == 0);
+
+	INSTR_TIME_SET_ZERO(timer->total);
+
+	if (timer->timed)
+		INSTR_TIME_SET_CURRENT(timer->start);
+}
+
+/* pauses the timer (e.g. while calling the standard executor) */
+void
+query_hist_timer_pause(hook_timer_t *timer)
+{
+	instr_time	end;
+
+	if (! timer->timed)
+		return;
+
+	INSTR_TIME_SET_CURRENT(end);
+	INSTR_TIME_ACCUM_DIFF(timer->total, end, timer->start);
+}
+
+/* resumes the paused timer */
+void
+query_hist_timer_resume(hook_timer_t *timer)
+{
+	if (timer->timed)
+		INSTR_TIME_SET_CURRENT(timer->start);
+}
+
+/* stops the timer, and adds the time to the counters */
+void
+query_hist_timer_stop(hook_timer_t *timer)
+{
+	if (! timer->timed)
+		return;
+
+	query_hist_timer_pause(timer);
+
+	internal_pending_added();
+
+	pending_internal.hook_samples++;
+	pending_internal.hook_time += INSTR_TIME_GET_NS(timer->total);
+}
+
+void
+query_hist_internal_reset()
+{
+	if (! shared_internal)
+		return;
+
+	memset(&pending_internal, 0, sizeof(internal_stats_t));
+
+	pg_atomic_write_u64(&(shared_internal->recorded), 0);
+	pg_atomic_write_u64(&(shared_internal->skipped), 0);
+	pg_atomic_write_u64(&(shared_internal->lock_acquisitions), 0);
+	pg_atomic_write_u64(&(shared_internal->lock_wait_samples), 0);
+	pg_atomic_write_u64(&(shared_internal->lock_wait_time), 0);
+	pg_atomic_write_u64(&(shared_internal->hook_calls), 0);
+	pg_atomic_write_u64(&(shared_internal->hook_samples), 0);
+	pg_atomic_write_u64(&(shared_internal->hook_time), 0);
+}
+
+/* current values of the counters (including our own pending ones) */
+internal_stats_t *
+query_hist_get_internal_stats()
+{
+	internal_stats_t *stats;
+
+	if (! shared_internal) {
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("query_histogram must be loaded via shared_preload_libraries")));
+	}
+
+	internal_flush();
+
+	stats = (internal_stats_t *) palloc(sizeof(internal_stats_t));
+
+	stats->recorded = pg_atomic_read_u64(&(shared_internal->recorded));
+	stats->skipped = pg_atomic_read_u64(&(shared_internal->skipped));
+	stats->lock_acquisitions = pg_atomic_read_u64(&(shared_internal->lock_acquisitions));
+	stats->lock_wait_samples = pg_atomic_read_u64(&(shared_internal->lock_wait_samples));
+	stats->lock_wait_time = pg_atomic_read_u64(&(shared_internal->lock_wait_time));
+	stats->hook_calls = pg_atomic_read_u64(&(shared_internal->hook_calls));
+	stats->hook_samples = pg_atomic_read_u64(&(shared_internal->hook_samples));
+	stats->hook_time = pg_atomic_read_u64(&(shared_internal->hook_time));
+
+	return stats;
+}
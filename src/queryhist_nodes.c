@@ -0,0 +1,258 @@
+#include "postgres.h"
+
+#include "executor/instrument.h"
+#include "nodes/execnodes.h"
+#include "nodes/nodeFuncs.h"
+
+#include "queryhist.h"
+
+/*
+ * Per-node-type histograms, i.e. how much time the queries spend in the
+ * various plan nodes (exclusive time, not including the child nodes). This
+ * requires per-node instrumentation with timing, which is rather expensive,
+ * so it's enabled only for a small sub-sample of the sampled queries (see
+ * query_histogram.node_sample_pct).
+ *
+ * The exclusive time is summed for all nodes of the same type in the query,
+ * and then added to the histogram for that node type (so each query counts
+ * only once for each node type).
+ */
+
+static bool node_times_walker(PlanState *planstate, void *context);
+static bool node_children_walker(PlanState *planstate, void *context);
+static double node_total_time(PlanState *planstate);
+static node_histogram_t * get_node_histogram(node_histogram_t *nodes, NodeTag tag);
+
+/* total time of the node (including children), in seconds */
+static double
+node_total_time(PlanState *planstate)
+{
+	if (! planstate->instrument)
+		return 0;
+
+	/* it's fine to call this multiple times (e.g. by auto_explain) */
+	InstrEndLoop(planstate->instrument);
+
+	return planstate->instrument->total;
+}
+
+/* sums the total time of the direct children */
+static bool
+node_children_walker(PlanState *planstate, void *context)
+{
+	*((double *) context) += node_total_time(planstate);
+
+	return false;
+}
+
+static bool
+node_times_walker(PlanState *planstate, void *context)
+{
+	histogram_sample_t *sample = (histogram_sample_t *) context;
+	NodeTag		tag = nodeTag(planstate->plan);
+	double		children = 0;
+	double		exclusive;
+	int			i;
+
+	planstate_tree_walker(planstate, node_children_walker, &children);
+
+	/* with parallel workers the children may have more time than the parent */
+	exclusive = Max(node_total_time(planstate) - children, 0);
+
+	for (i = 0; i < sample->nnodes; i++) {
+		if (sample->node_tags[i] == tag)
+			break;
+	}
+
+	if (i == sample->nnodes) {
+
+		/* should not happen, there are not that many node types */
+		if (sample->nnodes == NODE_TYPES_MAX)
+			return planstate_tree_walker(planstate, node_times_walker, context);
+
+		sample->node_tags[i] = tag;
+		sample->node_times[i] = 0;
+		sample->nnodes++;
+	}
+
+	sample->node_times[i] += exclusive;
+
+	return planstate_tree_walker(planstate, node_times_walker, context);
+}
+
+/* Walks the (instrumented) plan and sums exclusive time by node type. */
+void
+query_hist_collect_node_times(PlanState *planstate, histogram_sample_t *sample)
+{
+	sample->nnodes = 0;
+
+	node_times_walker(planstate, sample);
+}
+
+/* returns the histogram for the node type (adding it if needed) */
+static node_histogram_t *
+get_node_histogram(node_histogram_t *nodes, NodeTag tag)
+{
+	int i;
+
+	for (i = 0; i < NODE_TYPES_MAX; i++) {
+
+		if (nodes[i].tag == tag)
+			return &nodes[i];
+
+		if (nodes[i].tag == T_Invalid) {
+			nodes[i].tag = tag;
+			return &nodes[i];
+		}
+	}
+
+	return NULL;
+}
+
+/* adds times from the sample to the histograms (shared or pending) */
+void
+query_hist_add_node_times(node_histogram_t *nodes, histogram_sample_t *sample)
+{
+	int i;
+
+	for (i = 0; i < sample->nnodes; i++) {
+
+		node_histogram_t *hist = get_node_histogram(nodes, sample->node_tags[i]);
+		int bin = get_log2_bin((uint64) (sample->node_times[i] * 1000000.0), NODE_BINS);
+
+		if (! hist)
+			continue;
+
+		hist->count_bins[bin] += 1;
+		hist->time_bins[bin]  += sample->node_times[i];
+	}
+}
+
+/* merges the pending histograms into the shared ones */
+void
+query_hist_merge_node_times(node_histogram_t *dst, node_histogram_t *src)
+{
+	int i, j;
+
+	for (i = 0; (i < NODE_TYPES_MAX) && (src[i].tag != T_Invalid); i++) {
+
+		node_histogram_t *hist = get_node_histogram(dst, src[i].tag);
+
+		if (! hist)
+			continue;
+
+		for (j = 0; j < NODE_BINS; j++) {
+			hist->count_bins[j] += src[i].count_bins[j];
+			hist->time_bins[j]  += src[i].time_bins[j];
+		}
+	}
+}
+
+/* name of the plan node type (the same as in EXPLAIN) */
+const char *
+query_hist_node_name(NodeTag tag)
+{
+	switch (tag)
+	{
+		case T_Result:
+			return "Result";
+#if (PG_VERSION_NUM >= 100000)
+		case T_ProjectSet:
+			return "ProjectSet";
+#endif
+		case T_ModifyTable:
+			return "ModifyTable";
+		case T_Append:
+			return "Append";
+		case T_MergeAppend:
+			return "Merge Append";
+		case T_RecursiveUnion:
+			return "Recursive Union";
+		case T_BitmapAnd:
+			return "BitmapAnd";
+		case T_BitmapOr:
+			return "BitmapOr";
+		case T_NestLoop:
+			return "Nested Loop";
+		case T_MergeJoin:
+			return "Merge Join";
+		case T_HashJoin:
+			return "Hash Join";
+		case T_SeqScan:
+			return "Seq Scan";
+		case T_SampleScan:
+			return "Sample Scan";
+		case T_Gather:
+			return "Gather";
+#if (PG_VERSION_NUM >= 100000)
+		case T_GatherMerge:
+			return "Gather Merge";
+#endif
+		case T_IndexScan:
+			return "Index Scan";
+		case T_IndexOnlyScan:
+			return "Index Only Scan";
+		case T_BitmapIndexScan:
+			return "Bitmap Index Scan";
+		case T_BitmapHeapScan:
+			return "Bitmap Heap Scan";
+		case T_TidScan:
+			return "Tid Scan";
+#if (PG_VERSION_NUM >= 140000)
+		case T_TidRangeScan:
+			return "Tid Range Scan";
+#endif
+		case T_SubqueryScan:
+			return "Subquery Scan";
+		case T_FunctionScan:
+			return "Function Scan";
+#if (PG_VERSION_NUM >= 100000)
+		case T_TableFuncScan:
+			return "Table Function Scan";
+#endif
+		case T_ValuesScan:
+			return "Values Scan";
+		case T_CteScan:
+			return "CTE Scan";
+#if (PG_VERSION_NUM >= 100000)
+		case T_NamedTuplestoreScan:
+			return "Named Tuplestore Scan";
+#endif
+		case T_WorkTableScan:
+			return "WorkTable Scan";
+		case T_ForeignScan:
+			return "Foreign Scan";
+		case T_CustomScan:
+			return "Custom Scan";
+		case T_Material:
+			return "Materialize";
+#if (PG_VERSION_NUM >= 140000)
+		case T_Memoize:
+			return "Memoize";
+#endif
+		case T_Sort:
+			return "Sort";
+#if (PG_VERSION_NUM >= 130000)
+		case T_IncrementalSort:
+			return "Incremental Sort";
+#endif
+		case T_Group:
+			return "Group";
+		case T_Agg:
+			return "Aggregate";
+		case T_WindowAgg:
+			return "WindowAgg";
+		case T_Unique:
+			return "Unique";
+		case T_SetOp:
+			return "SetOp";
+		case T_LockRows:
+			return "LockRows";
+		case T_Limit:
+			return "Limit";
+		case T_Hash:
+			return "Hash";
+		default:
+			return "???";
+	}
+}
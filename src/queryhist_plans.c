@@ -0,0 +1,460 @@
+#include "postgres.h"
+#include "miscadmin.h"
+#include "port/atomics.h"
+#include "storage/ipc.h"
+#include "storage/shmem.h"
+#include "storage/spin.h"
+
+#include "nodes/plannodes.h"
+#include "parser/parsetree.h"
+#include "utils/hsearch.h"
+
+#include "queryhist.h"
+
+/*
+ * Per-plan histograms, i.e. a separate histogram of durations for each
+ * (queryId, plan) combination. The plan is identified by a hash of the plan
+ * shape (node types, join order and scanned relations / indexes), so when
+ * a query switches to a different plan, we get two separate histograms
+ * instead of a single bimodal one.
+ *
+ * The histograms are stored in a shared hash table with a fixed number of
+ * entries (query_histogram.max_plans) - when it's full, a batch of the least
+ * recently used entries is evicted (PLANS_EVICT_PCT of the table), so that
+ * we don't have to walk the whole table for each new plan. The table is not
+ * persisted.
+ *
+ * Just like pg_stat_statements, the lock is acquired in shared mode to look
+ * up an existing entry (the counters are protected by a per-entry spinlock),
+ * and in exclusive mode only to add a new entry or to evict entries.
+ */
+
+/* maximum number of entries (zero means disabled) */
+int query_histogram_max_plans = 0;
+
+/* percentage of entries to evict when the table is full (at least 10) */
+#define PLANS_EVICT_PCT		5
+#define PLANS_EVICT_MIN		10
+
+typedef struct plan_histogram_key {
+
+	Oid		dbid;
+	uint64	queryid;
+	uint64	planid;
+
+} plan_histogram_key;
+
+typedef struct plan_histogram_entry {
+
+	plan_histogram_key key;		/* hash key, must be first */
+
+	slock_t		mutex;			/* protects the fields below */
+
+	/* value of the usage counter when the entry was last used (eviction) */
+	uint64		last_used;
+
+	count_bin_t count_bins[PLAN_BINS];
+	time_bin_t  time_bins[PLAN_BINS];
+
+} plan_histogram_entry;
+
+/* shared state (the hash table is allocated separately) */
+typedef struct plan_histogram_info_t {
+
+	/* lock guarding the hash table (the entries have their own spinlock) */
+	LWLock	   *lock;
+
+	/* incremented for each query, used as a LRU clock */
+	pg_atomic_uint64 usage;
+
+} plan_histogram_info_t;
+
+static plan_histogram_info_t * shared_plans_info = NULL;
+static HTAB * shared_plans_hash = NULL;
+
+static uint64 plan_hash_combine(uint64 hash, uint64 value);
+static uint64 plan_hash_walk(uint64 hash, Plan *plan, List *rtable);
+static uint64 plan_hash_list(uint64 hash, List *plans, List *rtable);
+static uint64 plan_hash_relation(uint64 hash, Index scanrelid, List *rtable);
+static void plans_evict_entries(void);
+static int plans_last_used_cmp(const void *a, const void *b);
+
+Size
+query_hist_plans_shmem_size()
+{
+	return add_size(MAXALIGN(sizeof(plan_histogram_info_t)),
+					hash_estimate_size(query_histogram_max_plans,
+									   sizeof(plan_histogram_entry)));
+}
+
+void
+query_hist_plans_shmem_startup()
+{
+	bool		found;
+	HASHCTL		info;
+
+	if (query_histogram_max_plans == 0)
+		return;
+
+	LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+
+	shared_plans_info = ShmemInitStruct("query_histogram_plans",
+										sizeof(plan_histogram_info_t),
+										&found);
+
+	if (! found) {
+		shared_plans_info->lock = &(GetNamedLWLockTranche("query_histogram_plans"))->lock;
+		pg_atomic_init_u64(&(shared_plans_info->usage), 0);
+	}
+
+	memset(&info, 0, sizeof(info));
+	info.keysize = sizeof(plan_histogram_key);
+	info.entrysize = sizeof(plan_histogram_entry);
+
+	shared_plans_hash = ShmemInitHash("query_histogram_plans hash",
+									  query_histogram_max_plans,
+									  query_histogram_max_plans,
+									  &info,
+									  HASH_ELEM | HASH_BLOBS);
+
+	LWLockRelease(AddinShmemInitLock);
+}
+
+/* FNV-1a style mixing, we don't need anything fancy here */
+static uint64
+plan_hash_combine(uint64 hash, uint64 value)
+{
+	hash ^= value;
+	hash *= UINT64CONST(0x100000001b3);
+
+	return hash;
+}
+
+/* scanrelid may be zero (e.g. for a foreign join pushed down) */
+static uint64
+plan_hash_relation(uint64 hash, Index scanrelid, List *rtable)
+{
+	if (scanrelid == 0)
+		return plan_hash_combine(hash, InvalidOid);
+
+	return plan_hash_combine(hash, rt_fetch(scanrelid, rtable)->relid);
+}
+
+static uint64
+plan_hash_list(uint64 hash, List *plans, List *rtable)
+{
+	ListCell *lc;
+
+	foreach(lc, plans)
+		hash = plan_hash_walk(hash, (Plan *) lfirst(lc), rtable);
+
+	return hash;
+}
+
+/*
+ * Walks the plan tree and computes hash of the plan shape - the node types
+ * in the order of the walk (so the join order matters), the scanned
+ * relations and indexes. The costs, row estimates, expressions etc. are
+ * ignored on purpose.
+ */
+static uint64
+plan_hash_walk(uint64 hash, Plan *plan, List *rtable)
+{
+	if (plan == NULL)
+		return plan_hash_combine(hash, 0);
+
+	hash = plan_hash_combine(hash, nodeTag(plan));
+
+	switch (nodeTag(plan))
+	{
+		/* scans of regular relations - include the relation */
+		case T_SeqScan:
+		case T_SampleScan:
+		case T_BitmapHeapScan:
+		case T_TidScan:
+		case T_ForeignScan:
+			hash = plan_hash_relation(hash, ((Scan *) plan)->scanrelid, rtable);
+			break;
+
+		/* index scans - include the relation and the index */
+		case T_IndexScan:
+			hash = plan_hash_relation(hash, ((Scan *) plan)->scanrelid, rtable);
+			hash = plan_hash_combine(hash, ((IndexScan *) plan)->indexid);
+			break;
+
+		case T_IndexOnlyScan:
+			hash = plan_hash_relation(hash, ((Scan *) plan)->scanrelid, rtable);
+			hash = plan_hash_combine(hash, ((IndexOnlyScan *) plan)->indexid);
+			break;
+
+		case T_BitmapIndexScan:
+			hash = plan_hash_combine(hash, ((BitmapIndexScan *) plan)->indexid);
+			break;
+
+		/* nodes with children not in lefttree/righttree */
+		case T_Append:
+			hash = plan_hash_list(hash, ((Append *) plan)->appendplans, rtable);
+			break;
+
+		case T_MergeAppend:
+			hash = plan_hash_list(hash, ((MergeAppend *) plan)->mergeplans, rtable);
+			break;
+
+		case T_BitmapAnd:
+			hash = plan_hash_list(hash, ((BitmapAnd *) plan)->bitmapplans, rtable);
+			break;
+
+		case T_BitmapOr:
+			hash = plan_hash_list(hash, ((BitmapOr *) plan)->bitmapplans, rtable);
+			break;
+
+		case T_SubqueryScan:
+			hash = plan_hash_walk(hash, ((SubqueryScan *) plan)->subplan, rtable);
+			break;
+
+		case T_CustomScan:
+			hash = plan_hash_list(hash, ((CustomScan *) plan)->custom_plans, rtable);
+			break;
+
+#if (PG_VERSION_NUM < 140000)
+		case T_ModifyTable:
+			hash = plan_hash_list(hash, ((ModifyTable *) plan)->plans, rtable);
+			break;
+#endif
+
+		default:
+			break;
+	}
+
+	hash = plan_hash_walk(hash, plan->lefttree, rtable);
+	hash = plan_hash_walk(hash, plan->righttree, rtable);
+
+	return hash;
+}
+
+/* hash of the plan shape, including the subplans (e.g. for SubPlan nodes) */
+uint64
+query_hist_plan_hash(PlannedStmt *stmt)
+{
+	uint64 hash = UINT64CONST(0xcbf29ce484222325);
+
+	hash = plan_hash_walk(hash, stmt->planTree, stmt->rtable);
+	hash = plan_hash_list(hash, stmt->subplans, stmt->rtable);
+
+	return hash;
+}
+
+/* sorts the entries by the last use (oldest first) */
+static int
+plans_last_used_cmp(const void *a, const void *b)
+{
+	uint64		la = (*(plan_histogram_entry * const *) a)->last_used;
+	uint64		lb = (*(plan_histogram_entry * const *) b)->last_used;
+
+	if (la < lb)
+		return -1;
+	else if (la > lb)
+		return 1;
+
+	return 0;
+}
+
+/* removes a batch of the least recently used entries (requires exclusive lock) */
+static void
+plans_evict_entries()
+{
+	HASH_SEQ_STATUS hash_seq;
+	plan_histogram_entry **entries;
+	plan_histogram_entry *entry;
+	int			nentries = 0;
+	int			nvictims;
+	int			i;
+
+	entries = (plan_histogram_entry **) palloc(hash_get_num_entries(shared_plans_hash) *
+											   sizeof(plan_histogram_entry *));
+
+	hash_seq_init(&hash_seq, shared_plans_hash);
+	while ((entry = hash_seq_search(&hash_seq)) != NULL)
+		entries[nentries++] = entry;
+
+	qsort(entries, nentries, sizeof(plan_histogram_entry *), plans_last_used_cmp);
+
+	nvictims = Max(PLANS_EVICT_MIN, nentries * PLANS_EVICT_PCT / 100);
+	nvictims = Min(nvictims, nentries);
+
+	for (i = 0; i < nvictims; i++)
+		hash_search(shared_plans_hash, &(entries[i]->key), HASH_REMOVE, NULL);
+
+	pfree(entries);
+}
+
+/* adds the (sampled) query to the histogram for the plan */
+void
+query_hist_plans_add(PlannedStmt *stmt, time_bin_t duration)
+{
+	plan_histogram_key key;
+	plan_histogram_entry *entry;
+	bool		found;
+	int			bin;
+	uint64		usage;
+
+	if (! shared_plans_hash)
+		return;
+
+	/* the padding is hashed too, so make sure it's zeroed */
+	memset(&key, 0, sizeof(plan_histogram_key));
+
+	key.dbid = MyDatabaseId;
+	key.queryid = (uint64) stmt->queryId;
+	key.planid = query_hist_plan_hash(stmt);
+
+	bin = get_log2_bin((uint64) (duration * 1000000.0), PLAN_BINS);
+
+	/* most of the time the entry already exists, so a shared lock is enough */
+	LWLockAcquire(shared_plans_info->lock, LW_SHARED);
+
+	entry = (plan_histogram_entry *) hash_search(shared_plans_hash, &key, HASH_FIND, NULL);
+
+	if (! entry) {
+
+		/* need an exclusive lock to add the entry */
+		LWLockRelease(shared_plans_info->lock);
+		LWLockAcquire(shared_plans_info->lock, LW_EXCLUSIVE);
+
+		/* make room for the new entry if needed (someone else might have
+		 * added it in the meantime, but evicting a bit early is harmless) */
+		if (hash_get_num_entries(shared_plans_hash) >= query_histogram_max_plans)
+			plans_evict_entries();
+
+		entry = (plan_histogram_entry *) hash_search(shared_plans_hash, &key, HASH_ENTER, &found);
+
+		if (! found) {
+			SpinLockInit(&(entry->mutex));
+			entry->last_used = 0;
+			memset(entry->count_bins, 0, sizeof(entry->count_bins));
+			memset(entry->time_bins,  0, sizeof(entry->time_bins));
+		}
+	}
+
+	usage = pg_atomic_add_fetch_u64(&(shared_plans_info->usage), 1);
+
+	SpinLockAcquire(&(entry->mutex));
+
+	entry->last_used = Max(entry->last_used, usage);
+
+	entry->count_bins[bin] += 1;
+	entry->time_bins[bin]  += duration;
+
+	SpinLockRelease(&(entry->mutex));
+
+	LWLockRelease(shared_plans_info->lock);
+}
+
+void
+query_hist_plans_reset()
+{
+	HASH_SEQ_STATUS hash_seq;
+	plan_histogram_entry *entry;
+
+	if (! shared_plans_hash)
+		return;
+
+	LWLockAcquire(shared_plans_info->lock, LW_EXCLUSIVE);
+
+	hash_seq_init(&hash_seq, shared_plans_hash);
+	while ((entry = hash_seq_search(&hash_seq)) != NULL)
+		hash_search(shared_plans_hash, &(entry->key), HASH_REMOVE, NULL);
+
+	LWLockRelease(shared_plans_info->lock);
+}
+
+/* histogram of the query (in the current database), summed over all the
+ * plans - returns false if there's no such query (or it's disabled) */
+bool
+query_hist_plans_query_data(uint64 queryid, count_bin_t *count_bins)
+{
+	int i;
+	bool found = false;
+	HASH_SEQ_STATUS hash_seq;
+	plan_histogram_entry *entry;
+
+	memset(count_bins, 0, sizeof(count_bin_t) * PLAN_BINS);
+
+	if (! shared_plans_hash)
+		return false;
+
+	LWLockAcquire(shared_plans_info->lock, LW_SHARED);
+
+	hash_seq_init(&hash_seq, shared_plans_hash);
+	while ((entry = hash_seq_search(&hash_seq)) != NULL)
+	{
+		if ((entry->key.dbid != MyDatabaseId) || (entry->key.queryid != queryid))
+			continue;
+
+		SpinLockAcquire(&(entry->mutex));
+		for (i = 0; i < PLAN_BINS; i++)
+			count_bins[i] += entry->count_bins[i];
+		SpinLockRelease(&(entry->mutex));
+
+		found = true;
+	}
+
+	LWLockRelease(shared_plans_info->lock);
+
+	return found;
+}
+
+plan_histogram_data *
+query_hist_get_plans_data(bool scale, int *nplans)
+{
+	int i, j;
+	double coeff = 0;
+	HASH_SEQ_STATUS hash_seq;
+	plan_histogram_entry *entry;
+	plan_histogram_data *data;
+
+	*nplans = 0;
+
+	if (! shared_plans_hash) {
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("per-plan histograms are disabled (query_histogram.max_plans=0)")));
+	}
+
+	if (scale && (get_hist_sample_pct() < 100))
+		coeff = (100.0 / get_hist_sample_pct());
+
+	/* we can do this using a shared lock */
+	LWLockAcquire(shared_plans_info->lock, LW_SHARED);
+
+	data = (plan_histogram_data *) palloc(sizeof(plan_histogram_data) *
+										  Max(hash_get_num_entries(shared_plans_hash), 1));
+
+	hash_seq_init(&hash_seq, shared_plans_hash);
+	while ((entry = hash_seq_search(&hash_seq)) != NULL)
+	{
+		plan_histogram_data *item = &data[(*nplans)++];
+
+		item->dbid = entry->key.dbid;
+		item->queryid = entry->key.queryid;
+		item->planid = entry->key.planid;
+
+		SpinLockAcquire(&(entry->mutex));
+		memcpy(item->count_bins, entry->count_bins, sizeof(entry->count_bins));
+		memcpy(item->time_bins,  entry->time_bins,  sizeof(entry->time_bins));
+		SpinLockRelease(&(entry->mutex));
+	}
+
+	LWLockRelease(shared_plans_info->lock);
+
+	if (coeff > 0) {
+		for (i = 0; i < *nplans; i++) {
+			for (j = 0; j < PLAN_BINS; j++) {
+				data[i].count_bins[j] = data[i].count_bins[j] * coeff;
+				data[i].time_bins[j]  = data[i].time_bins[j] * coeff;
+			}
+		}
+	}
+
+	return data;
+}
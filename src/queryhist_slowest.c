@@ -0,0 +1,221 @@
+#include "postgres.h"
+#include "miscadmin.h"
+#include "mb/pg_wchar.h"
+#include "port/atomics.h"
+#include "storage/ipc.h"
+#include "storage/shmem.h"
+
+#include "queryhist.h"
+
+/*
+ * The N slowest statements since the last reset (query_histogram.slowest_count),
+ * with the query text etc. so that it's possible to find out which queries
+ * ended in the last bins of the histogram.
+ *
+ * The statements are kept in a shared binary min-heap ordered by duration,
+ * so the fastest of the N statements is always at the top, and is replaced
+ * by a slower one. Most statements are not slow enough to get into the heap,
+ * so the duration of the fastest statement in the (full) heap is also kept
+ * in an atomic variable - the statements are compared to it before locking
+ * anything, so the fast path is a single atomic read.
+ */
+
+/* number of statements (zero means disabled) */
+int query_histogram_slowest_count = 0;
+
+typedef struct slowest_info_t {
+
+	/* lock guarding the heap */
+	LWLock	   *lock;
+
+	/* duration (in microseconds) a statement has to exceed to get into the
+	 * heap, i.e. the fastest one in the heap (0 until the heap is full) */
+	pg_atomic_uint64 min_duration;
+
+	int			nqueries;
+	slow_query_t queries[FLEXIBLE_ARRAY_MEMBER];
+
+} slowest_info_t;
+
+static slowest_info_t * shared_slowest_info = NULL;
+
+static void slowest_sift_up(int idx);
+static void slowest_sift_down(int idx);
+static void slowest_swap(int a, int b);
+
+Size
+query_hist_slowest_shmem_size()
+{
+	return MAXALIGN(add_size(offsetof(slowest_info_t, queries),
+							 mul_size(query_histogram_slowest_count, sizeof(slow_query_t))));
+}
+
+void
+query_hist_slowest_shmem_startup()
+{
+	bool		found;
+
+	if (query_histogram_slowest_count == 0)
+		return;
+
+	LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+
+	shared_slowest_info = ShmemInitStruct("query_histogram_slowest",
+										  query_hist_slowest_shmem_size(),
+										  &found);
+
+	if (! found) {
+		shared_slowest_info->lock = &(GetNamedLWLockTranche("query_histogram_slowest"))->lock;
+		shared_slowest_info->nqueries = 0;
+		pg_atomic_init_u64(&(shared_slowest_info->min_duration), 0);
+	}
+
+	LWLockRelease(AddinShmemInitLock);
+}
+
+static void
+slowest_swap(int a, int b)
+{
+	slow_query_t tmp;
+
+	memcpy(&tmp, &(shared_slowest_info->queries[a]), sizeof(slow_query_t));
+	memcpy(&(shared_slowest_info->queries[a]), &(shared_slowest_info->queries[b]), sizeof(slow_query_t));
+	memcpy(&(shared_slowest_info->queries[b]), &tmp, sizeof(slow_query_t));
+}
+
+static void
+slowest_sift_up(int idx)
+{
+	slow_query_t *queries = shared_slowest_info->queries;
+
+	while (idx > 0)
+	{
+		int		parent = (idx - 1) / 2;
+
+		if (queries[parent].duration <= queries[idx].duration)
+			break;
+
+		slowest_swap(parent, idx);
+		idx = parent;
+	}
+}
+
+static void
+slowest_sift_down(int idx)
+{
+	slow_query_t *queries = shared_slowest_info->queries;
+	int		n = shared_slowest_info->nqueries;
+
+	for (;;)
+	{
+		int		smallest = idx;
+		int		left = 2 * idx + 1;
+		int		right = 2 * idx + 2;
+
+		if ((left < n) && (queries[left].duration < queries[smallest].duration))
+			smallest = left;
+
+		if ((right < n) && (queries[right].duration < queries[smallest].duration))
+			smallest = right;
+
+		if (smallest == idx)
+			break;
+
+		slowest_swap(smallest, idx);
+		idx = smallest;
+	}
+}
+
+/* adds the statement into the heap, if it's slow enough */
+void
+query_hist_slowest_add(uint64 queryid, const char *query, time_bin_t duration)
+{
+	uint64		duration_us = (uint64) (duration * 1000000.0);
+	slow_query_t *entry;
+	int			len;
+
+	if (! shared_slowest_info)
+		return;
+
+	/* fast path - not slower than the fastest query in a full heap */
+	if (duration_us <= pg_atomic_read_u64(&(shared_slowest_info->min_duration)))
+		return;
+
+	LWLockAcquire(shared_slowest_info->lock, LW_EXCLUSIVE);
+
+	/* someone might have added a slower query in the meantime */
+	if (duration_us <= pg_atomic_read_u64(&(shared_slowest_info->min_duration))) {
+		LWLockRelease(shared_slowest_info->lock);
+		return;
+	}
+
+	/* either append a new entry, or replace the fastest one (top) */
+	if (shared_slowest_info->nqueries < query_histogram_slowest_count)
+		entry = &(shared_slowest_info->queries[shared_slowest_info->nqueries++]);
+	else
+		entry = &(shared_slowest_info->queries[0]);
+
+	entry->queryid = queryid;
+	entry->dbid = MyDatabaseId;
+	entry->userid = GetUserId();
+	entry->duration = duration;
+	entry->timestamp = GetCurrentTimestamp();
+
+	/* don't cut the query in the middle of a multi-byte character */
+	len = strlen(query);
+	if (len >= SLOWEST_QUERY_LEN)
+		len = pg_mbcliplen(query, len, SLOWEST_QUERY_LEN - 1);
+
+	memcpy(entry->query, query, len);
+	entry->query[len] = '\0';
+
+	if (entry == &(shared_slowest_info->queries[0]))
+		slowest_sift_down(0);
+	else
+		slowest_sift_up(shared_slowest_info->nqueries - 1);
+
+	/* once the heap is full, only slower queries may get in */
+	if (shared_slowest_info->nqueries == query_histogram_slowest_count)
+		pg_atomic_write_u64(&(shared_slowest_info->min_duration),
+							(uint64) (shared_slowest_info->queries[0].duration * 1000000.0));
+
+	LWLockRelease(shared_slowest_info->lock);
+}
+
+void
+query_hist_slowest_reset()
+{
+	if (! shared_slowest_info)
+		return;
+
+	LWLockAcquire(shared_slowest_info->lock, LW_EXCLUSIVE);
+
+	shared_slowest_info->nqueries = 0;
+	pg_atomic_write_u64(&(shared_slowest_info->min_duration), 0);
+
+	LWLockRelease(shared_slowest_info->lock);
+}
+
+/* copy of the statements in the heap (in no particular order) */
+slow_query_t *
+query_hist_get_slowest_data(int *nqueries)
+{
+	slow_query_t *data;
+
+	if (! shared_slowest_info) {
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("capturing the slowest statements is disabled (query_histogram.slowest_count=0)")));
+	}
+
+	data = (slow_query_t *) palloc(sizeof(slow_query_t) * query_histogram_slowest_count);
+
+	LWLockAcquire(shared_slowest_info->lock, LW_SHARED);
+
+	*nqueries = shared_slowest_info->nqueries;
+	memcpy(data, shared_slowest_info->queries, sizeof(slow_query_t) * (*nqueries));
+
+	LWLockRelease(shared_slowest_info->lock);
+
+	return data;
+}
@@ -0,0 +1,310 @@
+#include "postgres.h"
+#include "miscadmin.h"
+#include "pgstat.h"
+#include "postmaster/bgworker.h"
+#include "storage/ipc.h"
+#include "storage/latch.h"
+#include "storage/proc.h"
+#include "storage/shmem.h"
+#include "tcop/tcopprot.h"
+#include "utils/guc.h"
+#include "utils/timestamp.h"
+
+#include "queryhist.h"
+
+/* the same as in pgstatfuncs.c (not exported by the server headers) */
+#ifndef UINT32_ACCESS_ONCE
+#define UINT32_ACCESS_ONCE(var)		 ((uint32)(*((volatile uint32 *)&(var))))
+#endif
+
+/*
+ * Wait event sampling, i.e. histograms of durations of wait episodes by wait
+ * event. A background worker periodically (query_histogram.wait_sample_rate
+ * times per second) looks at wait_event_info of all processes, and when a
+ * process stops waiting on an event (or starts waiting on a different one),
+ * the duration of the wait is added to the histogram of that wait event.
+ *
+ * The wait_event_info is read without any locking (just like for the
+ * pg_stat_activity view), so the backends are not affected at all. The
+ * durations are only estimates, though - the error is up to one sampling
+ * interval, and waits shorter than the interval are often not seen at all.
+ *
+ * The histograms are kept in a separate shared segment with a fixed number
+ * of slots (one per wait event), and are not persisted.
+ *
+ * The wait event classes (and WaitLatch with a wait event) exist only since
+ * PostgreSQL 10, so on older versions the sampling can't be enabled (see
+ * query_hist_waits_check_rate).
+ */
+
+/* number of samples per second (zero means disabled) */
+int query_histogram_wait_sample_rate = 0;
+
+typedef struct wait_histogram_info_t {
+
+	/* lock guarding the histograms */
+	LWLock	   *lock;
+
+	/* histograms by wait event (wait_event_info = 0 means unused slot) */
+	wait_histogram_t waits[WAIT_EVENTS_MAX];
+
+} wait_histogram_info_t;
+
+/* what the worker saw in the last round, for each PGPROC */
+typedef struct wait_state_t {
+
+	int			pid;
+	uint32		wait_event_info;
+	TimestampTz	start;
+
+} wait_state_t;
+
+/* a wait that ended in the current round (added in a batch) */
+typedef struct wait_episode_t {
+
+	uint32		wait_event_info;
+	uint64		duration;		/* microseconds */
+
+} wait_episode_t;
+
+static wait_histogram_info_t * shared_waits_info = NULL;
+
+#if (PG_VERSION_NUM >= 100000)
+static bool waits_is_tracked(uint32 wait_event_info);
+static void waits_sample(wait_state_t *states, wait_episode_t *episodes, int nprocs);
+#endif
+static void waits_add_episode(uint32 wait_event_info, uint64 duration);
+
+/* GUC check hook of query_histogram.wait_sample_rate */
+bool
+query_hist_waits_check_rate(int *newval, void **extra, GucSource source)
+{
+#if (PG_VERSION_NUM < 100000)
+	if (*newval != 0) {
+		GUC_check_errdetail("Wait event sampling requires PostgreSQL 10 or newer.");
+		return false;
+	}
+#endif
+
+	return true;
+}
+
+Size
+query_hist_waits_shmem_size()
+{
+	return MAXALIGN(sizeof(wait_histogram_info_t));
+}
+
+void
+query_hist_waits_shmem_startup()
+{
+	bool		found;
+
+	if (query_histogram_wait_sample_rate == 0)
+		return;
+
+	LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+
+	shared_waits_info = ShmemInitStruct("query_histogram_waits",
+										sizeof(wait_histogram_info_t),
+										&found);
+
+	if (! found) {
+		shared_waits_info->lock = &(GetNamedLWLockTranche("query_histogram_waits"))->lock;
+		memset(shared_waits_info->waits, 0, sizeof(shared_waits_info->waits));
+	}
+
+	LWLockRelease(AddinShmemInitLock);
+}
+
+/* registers the sampling worker (called from _PG_init) */
+void
+query_hist_waits_register_worker()
+{
+	BackgroundWorker worker;
+
+	if (query_histogram_wait_sample_rate == 0)
+		return;
+
+	memset(&worker, 0, sizeof(worker));
+
+	worker.bgw_flags = BGWORKER_SHMEM_ACCESS;
+	worker.bgw_start_time = BgWorkerStart_ConsistentState;
+	worker.bgw_restart_time = 10;
+
+	snprintf(worker.bgw_name, BGW_MAXLEN, "query_histogram wait sampler");
+#if (PG_VERSION_NUM >= 110000)
+	snprintf(worker.bgw_type, BGW_MAXLEN, "query_histogram wait sampler");
+#endif
+	snprintf(worker.bgw_library_name, BGW_MAXLEN, "query_histogram");
+	snprintf(worker.bgw_function_name, BGW_MAXLEN, "query_hist_waits_main");
+
+	RegisterBackgroundWorker(&worker);
+}
+
+/* main loop of the sampling worker */
+void
+query_hist_waits_main(Datum main_arg)
+{
+#if (PG_VERSION_NUM >= 100000)
+	long		interval = Max(1000 / query_histogram_wait_sample_rate, 1);
+	int			nprocs;
+	wait_state_t   *states;
+	wait_episode_t *episodes;
+
+	pqsignal(SIGTERM, die);
+	BackgroundWorkerUnblockSignals();
+
+	/* the number of PGPROC entries is fixed */
+	nprocs = ProcGlobal->allProcCount;
+
+	states = (wait_state_t *) palloc0(sizeof(wait_state_t) * nprocs);
+	episodes = (wait_episode_t *) palloc(sizeof(wait_episode_t) * nprocs);
+
+	for (;;)
+	{
+		int		rc;
+
+		rc = WaitLatch(MyLatch, WL_LATCH_SET | WL_TIMEOUT | WL_POSTMASTER_DEATH,
+					   interval, PG_WAIT_EXTENSION);
+
+		ResetLatch(MyLatch);
+
+		if (rc & WL_POSTMASTER_DEATH)
+			proc_exit(1);
+
+		CHECK_FOR_INTERRUPTS();
+
+		waits_sample(states, episodes, nprocs);
+	}
+#else
+	/* never registered (the sampling can't be enabled before 10) */
+	proc_exit(0);
+#endif
+}
+
+#if (PG_VERSION_NUM >= 100000)
+
+/* Idle waits (main loops of background processes, sessions waiting for the
+ * next command) are not interesting, and would only drown the rest. */
+static bool
+waits_is_tracked(uint32 wait_event_info)
+{
+	if (wait_event_info == 0)
+		return false;
+
+	if ((wait_event_info & 0xFF000000) == PG_WAIT_ACTIVITY)
+		return false;
+
+	if (wait_event_info == WAIT_EVENT_CLIENT_READ)
+		return false;
+
+	return true;
+}
+
+/* looks at all the processes once, and adds the waits that ended */
+static void
+waits_sample(wait_state_t *states, wait_episode_t *episodes, int nprocs)
+{
+	int			i;
+	int			nepisodes = 0;
+	TimestampTz	now = GetCurrentTimestamp();
+
+	for (i = 0; i < nprocs; i++)
+	{
+		PGPROC	   *proc = &ProcGlobal->allProcs[i];
+		int			pid = proc->pid;
+		uint32		wait_event_info = UINT32_ACCESS_ONCE(proc->wait_event_info);
+
+		if ((proc == MyProc) || (pid == 0) || (! waits_is_tracked(wait_event_info)))
+			wait_event_info = 0;
+
+		/* still waiting on the same event (or still not waiting) */
+		if ((states[i].pid == pid) && (states[i].wait_event_info == wait_event_info))
+			continue;
+
+		/* the previous wait ended (or the process went away) */
+		if (states[i].wait_event_info != 0)
+		{
+			long		secs;
+			int			usecs;
+
+			TimestampDifference(states[i].start, now, &secs, &usecs);
+
+			episodes[nepisodes].wait_event_info = states[i].wait_event_info;
+			episodes[nepisodes].duration = (uint64) secs * 1000000 + usecs;
+			nepisodes++;
+		}
+
+		states[i].pid = pid;
+		states[i].wait_event_info = wait_event_info;
+		states[i].start = now;
+	}
+
+	if (nepisodes == 0)
+		return;
+
+	LWLockAcquire(shared_waits_info->lock, LW_EXCLUSIVE);
+
+	for (i = 0; i < nepisodes; i++)
+		waits_add_episode(episodes[i].wait_event_info, episodes[i].duration);
+
+	LWLockRelease(shared_waits_info->lock);
+}
+
+#endif
+
+/* needs to be already locked, waits without a free slot are ignored */
+static void
+waits_add_episode(uint32 wait_event_info, uint64 duration)
+{
+	int		i;
+	int		bin = get_log2_bin(duration, WAIT_BINS);
+
+	for (i = 0; i < WAIT_EVENTS_MAX; i++)
+	{
+		wait_histogram_t *wait = &(shared_waits_info->waits[i]);
+
+		if (wait->wait_event_info == 0)
+			wait->wait_event_info = wait_event_info;
+
+		if (wait->wait_event_info == wait_event_info)
+		{
+			wait->count_bins[bin] += 1;
+			wait->time_bins[bin]  += (duration / 1000000.0);
+			return;
+		}
+	}
+}
+
+void
+query_hist_waits_reset()
+{
+	if (! shared_waits_info)
+		return;
+
+	LWLockAcquire(shared_waits_info->lock, LW_EXCLUSIVE);
+	memset(shared_waits_info->waits, 0, sizeof(shared_waits_info->waits));
+	LWLockRelease(shared_waits_info->lock);
+}
+
+/* copy of the histograms (the used slots are at the beginning) */
+wait_histogram_t *
+query_hist_get_wait_data()
+{
+	wait_histogram_t * data;
+
+	if (! shared_waits_info) {
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("wait event sampling is disabled (query_histogram.wait_sample_rate=0)")));
+	}
+
+	data = (wait_histogram_t *) palloc(sizeof(wait_histogram_t) * WAIT_EVENTS_MAX);
+
+	LWLockAcquire(shared_waits_info->lock, LW_SHARED);
+	memcpy(data, shared_waits_info->waits, sizeof(wait_histogram_t) * WAIT_EVENTS_MAX);
+	LWLockRelease(shared_waits_info->lock);
+
+	return data;
+}
@@ -0,0 +1,78 @@
+# Checks that the recorded statements end up in the shared histogram, that
+# the histogram survives a clean restart, and that it can be reset. On 18
+# and newer the data go through the backend-local pending histogram and
+# the pgstat flush, and are thrown away after a crash.
+
+use strict;
+use warnings FATAL => 'all';
+
+use PostgreSQL::Test::Cluster;
+use PostgreSQL::Test::Utils;
+use Test::More;
+
+my $node = PostgreSQL::Test::Cluster->new('main');
+
+$node->init;
+$node->append_conf('postgresql.conf', qq{
+shared_preload_libraries = 'query_histogram'
+query_histogram.sample_pct = 100
+query_histogram.track_utility = off
+});
+$node->start;
+
+$node->safe_psql('postgres', 'CREATE EXTENSION query_histogram');
+
+# Runs the statements in a new session, and forces the flush of the pending
+# statistics once the last statement completes, so that all the statements
+# (including the pg_stat_force_next_flush call) are in the shared histogram
+# when this returns. Returns the output of the first statement.
+sub psql_flushed
+{
+	my ($sql) = @_;
+
+	my $out = $node->safe_psql('postgres',
+		"$sql;\nSELECT pg_stat_force_next_flush();");
+
+	return (split /\n/, $out)[0];
+}
+
+sub histogram_total
+{
+	return psql_flushed('SELECT sum(bin_count) FROM query_histogram(false)');
+}
+
+# the reset itself, three queries and the flush
+psql_flushed("SELECT query_histogram_reset();\nSELECT 1;\nSELECT 1;\nSELECT 1");
+
+is(histogram_total(), '5', 'statements are recorded');
+
+# the reading statement and its flush are recorded too
+$node->restart;
+
+is(histogram_total(), '7', 'histogram survives a clean restart');
+
+my $last_reset = psql_flushed('SELECT query_histogram_get_reset()');
+
+psql_flushed('SELECT query_histogram_reset()');
+
+is(histogram_total(), '2', 'reset discards the recorded statements');
+
+is(psql_flushed("SELECT query_histogram_get_reset() > '$last_reset'"),
+	't', 'reset updates the reset timestamp');
+
+# before 18 the histogram is loaded from the file written by the last
+# clean shutdown, so only check the crash on 18
+SKIP:
+{
+	skip 'crash discards the data only on 18 and newer', 1
+	  if $node->safe_psql('postgres', 'SHOW server_version_num') < 180000;
+
+	$node->stop('immediate');
+	$node->start;
+
+	is(histogram_total(), '0', 'histogram is discarded after a crash');
+}
+
+$node->stop;
+
+done_testing();
@@ -0,0 +1,63 @@
+# Checks the bin boundaries of the logarithmic histogram, and the
+# percentiles and confidence intervals computed from it. With 10ms bins
+# the bins are [0, 10), [10, 30), [30, 70), [70, 150), ... and the queries
+# sleeping for 100ms end up in the [70, 150) bin.
+
+use strict;
+use warnings FATAL => 'all';
+
+use PostgreSQL::Test::Cluster;
+use PostgreSQL::Test::Utils;
+use Test::More;
+
+my $node = PostgreSQL::Test::Cluster->new('main');
+
+$node->init;
+$node->append_conf('postgresql.conf', qq{
+shared_preload_libraries = 'query_histogram'
+query_histogram.sample_pct = 100
+query_histogram.track_utility = off
+query_histogram.histogram_type = log
+query_histogram.bin_width = 10
+query_histogram.bin_count = 10
+});
+$node->start;
+
+$node->safe_psql('postgres', 'CREATE EXTENSION query_histogram');
+
+# the reset and the flush go to the first bin, the sleeps to the fourth one
+$node->safe_psql('postgres', qq{
+SELECT query_histogram_reset();
+SELECT pg_sleep(0.1);
+SELECT pg_sleep(0.1);
+SELECT pg_sleep(0.1);
+SELECT pg_sleep(0.1);
+SELECT pg_stat_force_next_flush();
+});
+
+# everything in a single statement, so that it's not included in the data
+my $result = $node->safe_psql('postgres', qq{
+SELECT h.bin_from, h.bin_to, h.bin_count, h.bin_count_low, h.bin_count_high,
+       p25.value, p25.value_low, p25.value_high,
+       p50.value, p50.value_low, p50.value_high, p50.sample_count
+  FROM query_histogram(true) h,
+       query_histogram_percentile(0.25) p25,
+       query_histogram_percentile(0.5) p50
+ WHERE h.bin_count > 0
+ ORDER BY h.bin_from
+});
+
+my @bins = split /\n/, $result;
+
+is(scalar(@bins), 2, 'two non-empty bins');
+
+# rank 1.5 of 6, i.e. 3/4 into the [0, 10) bin with two queries, and
+# rank 3 of 6, i.e. 1/4 into the [70, 150) bin with four queries
+is($bins[0], '0|10|2|2|2|7.5|7.5|7.5|90|90|90|6',
+	'first bin and percentiles');
+is($bins[1], '70|150|4|4|4|7.5|7.5|7.5|90|90|90|6',
+	'logarithmic bin boundaries match the bin the queries are added to');
+
+$node->stop;
+
+done_testing();